@@ -33,48 +33,50 @@
  */
 
 #include <stdlib.h>
-#include <string.h>
 
 #include "base64.h"
 
 static const char code[]=
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static void
-encode(char *b, unsigned int c1, unsigned int c2, unsigned int c3, int n)
+/*
+ * Encode len bytes from src into dst, which must have room for
+ * 4 * ((len + 2) / 3) + 1 bytes.  Returns the length of the encoding,
+ * dst is terminated.
+ */
+size_t
+base64_encode(char *dst, const unsigned char *src, size_t len)
 {
-	unsigned long tuple = c3 + 256UL * (c2 + 256UL * c1);
-	int i;
-	char s[5];
+	char *d = dst;
+	unsigned long tuple;
 
-	for (i = 0; i < 4; i++) {
-		s[3 - i] = code[tuple % 64];
-		tuple /= 64;
+	for (; len >= 3; len -= 3, src += 3) {
+		tuple = (unsigned long)src[0] << 16 | src[1] << 8 | src[2];
+		*d++ = code[tuple >> 18];
+		*d++ = code[(tuple >> 12) & 63];
+		*d++ = code[(tuple >> 6) & 63];
+		*d++ = code[tuple & 63];
 	}
-	for (i = n + 1; i < 4; i++)
-		s[i] = '=';
-	s[4] = '\0';
-	strcat(b, s);
+	if (len > 0) {
+		tuple = (unsigned long)src[0] << 16;
+		if (len == 2)
+			tuple |= src[1] << 8;
+		*d++ = code[tuple >> 18];
+		*d++ = code[(tuple >> 12) & 63];
+		*d++ = len == 2 ? code[(tuple >> 6) & 63] : '=';
+		*d++ = '=';
+	}
+	*d = '\0';
+	return d - dst;
 }
 
 char *
 base64(unsigned char *s, size_t l)
 {
 	char *b;
-	int n;
 
-	b = calloc(l * 2, 1);
-	if (b) {
-		for (n = l / 3; n--; s += 3)
-			encode(b, s[0], s[1], s[2], 3);
-		switch (l % 3) {
-		case 1:
-			encode(b, s[0], 0, 0, 1);
-			break;
-		case 2:
-			encode(b, s[0], s[1], 0, 2);
-			break;
-		}
-	}
+	b = malloc(4 * ((l + 2) / 3) + 1);
+	if (b)
+		base64_encode(b, s, l);
 	return b;
 }
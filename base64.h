@@ -25,6 +25,12 @@
 #ifndef __BASE64_H__
 #define __BASE64_H__
 
+#include <stddef.h>
+
+/* Length of the encoding of n bytes, without the terminating NUL */
+#define BASE64_LENGTH(n)	(4 * (((n) + 2) / 3))
+
+extern size_t base64_encode(char *, const unsigned char *, size_t);
 extern char *base64(unsigned char *, size_t);
 
 #endif /* __BASE64_H__ */
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Count the bytes copied per received message.  Frames are read from
+ * memory through wsRead() as from a socket: the read function stands for
+ * the copy from the kernel into the read-ahead buffer and pushString() for
+ * lua_pushlstring() in ws:recv(), which copies the message into a new
+ * string.  Copies within websocket.c are counted by wrapping memcpy() and
+ * memmove(); those of eight bytes or less are word loads of the kernels
+ * and frame headers.  Growing a buffer with realloc() is not counted, it
+ * only happens while the buffers warm up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t copied;
+
+static void *
+countMemcpy(void *dst, const void *src, size_t len)
+{
+	if (len > 8)
+		copied += len;
+	return memcpy(dst, src, len);
+}
+
+static void *
+countMemmove(void *dst, const void *src, size_t len)
+{
+	if (len > 8)
+		copied += len;
+	return memmove(dst, src, len);
+}
+
+#define memcpy(dst, src, len)	countMemcpy(dst, src, len)
+#define memmove(dst, src, len)	countMemmove(dst, src, len)
+#include "../websocket.c"
+#undef memcpy
+#undef memmove
+
+#include "bench.h"
+
+#define MESSAGES	64
+#define READ_SIZE	16384	/* what one recv() returns at most */
+
+static uint8_t *input;
+static size_t inputlen, inputpos, kernel;
+
+static int
+readInput(void *arg, unsigned char *dest, size_t len)
+{
+	size_t n;
+
+	if ((n = inputlen - inputpos) == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (n > len)
+		n = len;
+	if (n > READ_SIZE)
+		n = READ_SIZE;
+	memcpy(dest, input + inputpos, n);
+	inputpos += n;
+	kernel += n;
+	return n;
+}
+
+static int
+writeOutput(void *arg, unsigned char *data, size_t len)
+{
+	return len;
+}
+
+/* Append a masked client frame */
+static size_t
+putFrame(uint8_t *out, int fin, enum wsFrameType type, const uint8_t *data,
+    size_t len)
+{
+	static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	size_t hlen, n;
+
+	hlen = wsMakeFrameHeader(len, out, type);
+	out[0] = (fin ? 0x80 : 0) | type;
+	out[1] |= 0x80;
+	memcpy(out + hlen, key, sizeof(key));
+	hlen += sizeof(key);
+	for (n = 0; n < len; n++)
+		out[hlen + n] = data[n] ^ key[n & 3];
+	return hlen + len;
+}
+
+/* Like lua_pushlstring(), the string is allocated and the data copied */
+static void
+pushString(const char *data, size_t len)
+{
+	char *s;
+
+	if ((s = malloc(len + 1)) == NULL) {
+		printf("memory error\n");
+		exit(1);
+	}
+	countMemcpy(s, data, len);
+	s[len] = '\0';
+	free(s);
+}
+
+static void
+measure(size_t size, int fragments)
+{
+	struct wsReader reader;
+	uint8_t *payload;
+	size_t n, f, part, off, len, wsread, pushed;
+	char *msg;
+	int nmsgs;
+
+	payload = malloc(size);
+	input = malloc(MESSAGES * (size + fragments * 14));
+	for (n = 0; n < size; n++)
+		payload[n] = 'a' + n % 26;
+	for (inputlen = 0, n = 0; n < MESSAGES; n++) {
+		for (off = 0, f = 0; f < fragments; f++, off += part) {
+			part = f == fragments - 1 ? size - off : size / fragments;
+			inputlen += putFrame(input + inputlen,
+			    f == fragments - 1, f ? WS_CONTINUATION_FRAME :
+			    WS_TEXT_FRAME, payload + off, part);
+		}
+	}
+
+	nullReader(&reader);
+	inputpos = kernel = copied = wsread = pushed = 0;
+	for (nmsgs = 0; wsRead(&reader, &msg, &len, readInput, writeOutput,
+	    NULL) == WS_TEXT_FRAME; nmsgs++) {
+		wsread += copied;
+		copied = 0;
+		pushString(msg, len);
+		pushed += copied;
+		copied = 0;
+	}
+	wsread += copied;
+	freeReader(&reader);
+	if (nmsgs != MESSAGES) {
+		printf("%zu bytes: %d of %d messages read\n", size, nmsgs,
+		    MESSAGES);
+		exit(1);
+	}
+
+	/* Per payload byte: read, in wsRead(), into Lua and total */
+	printf("%9zu %9d %8.2f %8.2f %8.2f %8.2f\n", size, fragments,
+	    (double)kernel / (size * MESSAGES),
+	    (double)wsread / (size * MESSAGES),
+	    (double)pushed / (size * MESSAGES),
+	    (double)(kernel + wsread + pushed) / (size * MESSAGES));
+	free(payload);
+	free(input);
+}
+
+int
+main(void)
+{
+	static const size_t sizes[] = { 64, 1024, 16384, 262144, 4194304 };
+	size_t n;
+
+	printf("bytes copied per payload byte\n");
+	printf("%9s %9s %8s %8s %8s %8s\n", "message", "fragments",
+	    "read", "wsRead", "Lua", "total");
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		measure(sizes[n], 1);
+		measure(sizes[n], 4);
+	}
+	return 0;
+}
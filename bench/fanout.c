@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * CPU time of broadcasting a stream of compressed messages to a thousand
+ * subscribers.  Without sharing, every subscriber compresses each message
+ * with its own deflater, keeping the context as negotiated.  With sharing,
+ * as websocket.frame() does, a message is compressed once without context
+ * takeover and every subscriber only resets its deflater.  Sending itself
+ * is not included, it costs the same either way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "websocket.h"
+#include "bench.h"
+
+#define SUBSCRIBERS	1000
+#define MESSAGES	20
+
+/* Price updates in JSON, consecutive messages have much in common */
+static size_t
+makeMessage(char *buf, size_t size, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len)
+		n += snprintf(buf + n, size - n,
+		    "{\"sym\":\"S%03u\",\"price\":%u.%02u,\"volume\":%u},",
+		    bench_random() % 50, 100 + bench_random() % 20,
+		    bench_random() % 100, bench_random() % 10000);
+	return len;
+}
+
+static void
+measure(size_t len)
+{
+	static struct wsDeflater subscriber[SUBSCRIBERS];
+	struct wsDeflater shared;
+	struct wsDeflateParams params;
+	char msg[MESSAGES][16384 + 128];
+	double start, own, once;
+	size_t ownbytes, sharedbytes;
+	int m, n;
+
+	for (m = 0; m < MESSAGES; m++)
+		makeMessage(msg[m], sizeof(msg[m]), len);
+
+	wsDefaultDeflate(&params);
+	for (n = 0; n < SUBSCRIBERS; n++) {
+		nullDeflater(&subscriber[n]);
+		wsSetDeflater(&subscriber[n], &params);
+	}
+	nullDeflater(&shared);
+	params.serverNoContextTakeover = 1;
+	params.threshold = 0;
+	wsSetDeflater(&shared, &params);
+
+	/* Create the zlib streams before measuring */
+	for (n = 0; n < SUBSCRIBERS; n++) {
+		wsDeflateFrame(&subscriber[n], (uint8_t *)msg[0], len,
+		    WS_TEXT_FRAME);
+		wsResetDeflater(&subscriber[n]);
+	}
+
+	ownbytes = 0;
+	start = bench_now();
+	for (m = 0; m < MESSAGES; m++)
+		for (n = 0; n < SUBSCRIBERS; n++) {
+			subscriber[n].buflen = 0;
+			if (wsDeflateFrame(&subscriber[n], (uint8_t *)msg[m],
+			    len, WS_TEXT_FRAME)) {
+				printf("compression error\n");
+				exit(1);
+			}
+			ownbytes += subscriber[n].buflen;
+		}
+	own = bench_now() - start;
+
+	sharedbytes = 0;
+	start = bench_now();
+	for (m = 0; m < MESSAGES; m++) {
+		shared.buflen = 0;
+		if (wsDeflateFrame(&shared, (uint8_t *)msg[m], len,
+		    WS_TEXT_FRAME)) {
+			printf("compression error\n");
+			exit(1);
+		}
+		for (n = 0; n < SUBSCRIBERS; n++) {
+			wsResetDeflater(&subscriber[n]);
+			sharedbytes += shared.buflen;
+		}
+	}
+	once = bench_now() - start;
+
+	printf("%9zu %12.1f %12.1f %8.0fx %10.0f %10.0f\n", len,
+	    own / MESSAGES * 1e3, once / MESSAGES * 1e3, own / once,
+	    (double)ownbytes / (MESSAGES * SUBSCRIBERS),
+	    (double)sharedbytes / (MESSAGES * SUBSCRIBERS));
+
+	for (n = 0; n < SUBSCRIBERS; n++)
+		freeDeflater(&subscriber[n]);
+	freeDeflater(&shared);
+}
+
+int
+main(void)
+{
+	static const size_t sizes[] = { 256, 2048, 16384 };
+	size_t n;
+
+	printf("ms per message to %d subscribers, bytes per frame\n",
+	    SUBSCRIBERS);
+	printf("%9s %12s %12s %9s %10s %10s\n", "message", "per client",
+	    "shared", "speedup", "own frame", "shared");
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+		measure(sizes[n]);
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Opening handshakes parsed per second on one core: a minimal request, one
+ * as a browser sends it and one carrying two kilobytes of cookies.  Each is
+ * parsed alone and together with building the answer.  Allocations are
+ * counted by wrapping malloc(), calloc() and realloc(), the parser itself
+ * must not make any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t allocs;
+
+static void *
+countMalloc(size_t size)
+{
+	allocs++;
+	return malloc(size);
+}
+
+static void *
+countCalloc(size_t n, size_t size)
+{
+	allocs++;
+	return calloc(n, size);
+}
+
+static void *
+countRealloc(void *p, size_t size)
+{
+	allocs++;
+	return realloc(p, size);
+}
+
+#define malloc(size)		countMalloc(size)
+#define calloc(n, size)		countCalloc(n, size)
+#define realloc(p, size)	countRealloc(p, size)
+#include "../websocket.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+#include "bench.h"
+
+#define DURATION	1.0	/* seconds per measurement */
+
+static const char minimal[] =
+	"GET / HTTP/1.1\r\n"
+	"Host: a\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n";
+
+static const char browser[] =
+	"GET /chat HTTP/1.1\r\n"
+	"Host: server.example.com\r\n"
+	"Connection: keep-alive, Upgrade\r\n"
+	"Pragma: no-cache\r\n"
+	"Cache-Control: no-cache\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+	    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+	"Upgrade: websocket\r\n"
+	"Origin: https://example.com\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Extensions: permessage-deflate; "
+	    "client_max_window_bits\r\n"
+	"\r\n";
+
+static char cookies[WS_MAX_HANDSHAKE];
+
+static void
+measure(const char *name, const char *request)
+{
+	struct handshake hs;
+	uint8_t answer[WS_MAX_ANSWER];
+	size_t len, answerlen, n, before;
+	double start, elapsed;
+
+	len = strlen(request);
+	nullHandshake(&hs);
+	before = allocs;
+	if (wsParseHandshake((const uint8_t *)request, len, &hs) !=
+	    WS_OPENING_FRAME || hs.key.len != 24) {
+		printf("%s: not parsed\n", name);
+		exit(1);
+	}
+	printf("%-8s %6zu bytes %4zu allocs", name, len, allocs - before);
+
+	n = 0;
+	start = bench_now();
+	do {
+		for (int i = 0; i < 10000; i++, n++)
+			wsParseHandshake((const uint8_t *)request, len, &hs);
+	} while ((elapsed = bench_now() - start) < DURATION);
+	printf(" %10.0f parsed/s", n / elapsed);
+
+	n = 0;
+	start = bench_now();
+	do {
+		for (int i = 0; i < 1000; i++, n++) {
+			wsParseHandshake((const uint8_t *)request, len, &hs);
+			answerlen = sizeof(answer);
+			wsGetHandshakeAnswer(&hs, answer, &answerlen);
+		}
+	} while ((elapsed = bench_now() - start) < DURATION);
+	printf(" %10.0f answered/s\n", n / elapsed);
+	freeHandshake(&hs);
+}
+
+int
+main(void)
+{
+	size_t len;
+
+	len = snprintf(cookies, sizeof(cookies), "%.*s", (int)(sizeof(browser)
+	    - 3), browser);
+	len += snprintf(cookies + len, sizeof(cookies) - len, "Cookie: ");
+	while (len < sizeof(browser) + 2048)
+		len += snprintf(cookies + len, sizeof(cookies) - len,
+		    "c%04x=%08x; ", (unsigned)len, bench_random());
+	snprintf(cookies + len, sizeof(cookies) - len, "\r\n\r\n");
+
+	measure("minimal", minimal);
+	measure("browser", browser);
+	measure("cookies", cookies);
+	return 0;
+}
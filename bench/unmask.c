@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Unmasking throughput at payload sizes from 16 bytes to 16 MB: the byte
+ * loop wsParseInputFrame() used before against wsUnmask() with each of the
+ * kernels the CPU supports.  The payload starts three bytes past an aligned
+ * address, like one after a frame header, so the head is included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../websocket.c"
+#include "bench.h"
+
+#define MAXSIZE		(16 * 1024 * 1024)
+#define VOLUME		(256 * 1024 * 1024)	/* bytes per measurement */
+#define OFFSET		3
+
+static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+static void
+unmaskBytes(uint8_t *data, size_t len, const uint8_t *maskingKey)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		data[i] ^= maskingKey[i % 4];
+}
+
+static struct kernel {
+	const char	*name;
+	void		(*unmask)(uint8_t *, size_t, const uint8_t *);
+	int		 supported;
+} kernels[] = {
+	{ "word",	unmaskWord,	1 },
+#ifdef WS_HAVE_X86_SIMD
+	{ "sse2",	unmaskSSE2,	0 },
+	{ "avx2",	unmaskAVX2,	0 },
+#endif
+	{ NULL,		NULL,		0 }
+};
+
+/* GB/s of fn on len bytes */
+static double
+measure(void (*fn)(uint8_t *, size_t, const uint8_t *), uint8_t *data,
+    size_t len)
+{
+	double start;
+	size_t n, iterations;
+
+	iterations = VOLUME / len < 3 ? 3 : VOLUME / len;
+	start = bench_now();
+	for (n = 0; n < iterations; n++)
+		fn(data, len, key);
+	return (double)len * iterations / (bench_now() - start) / 1e9;
+}
+
+int
+main(void)
+{
+	struct kernel *k;
+	uint8_t *buf, *data, *copy;
+	size_t len, n;
+
+	if ((buf = aligned_alloc(64, MAXSIZE + 64)) == NULL ||
+	    (copy = malloc(MAXSIZE)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	data = buf + OFFSET;
+	for (n = 0; n < MAXSIZE; n++)
+		data[n] = bench_random();
+	memcpy(copy, data, MAXSIZE);
+
+	/* Selected first, so wsUnmask() does not replace the kernel set */
+	initKernels();
+#ifdef WS_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	kernels[1].supported = __builtin_cpu_supports("sse2");
+	kernels[2].supported = __builtin_cpu_supports("avx2");
+#endif
+
+	/* Every kernel must produce what the byte loop does */
+	for (k = kernels; k->name != NULL; k++) {
+		if (!k->supported)
+			continue;
+		unmaskKernel = k->unmask;
+		for (len = 0; len < 300; len++) {
+			wsUnmask(data, len, key);
+			unmaskBytes(data, len, key);
+			if (memcmp(data, copy, len)) {
+				printf("%s: wrong result at %zu bytes\n",
+				    k->name, len);
+				return 1;
+			}
+		}
+	}
+
+	printf("%9s %10s", "bytes", "byte loop");
+	for (k = kernels; k->name != NULL; k++)
+		if (k->supported)
+			printf(" %10s", k->name);
+	printf("   (GB/s)\n");
+	for (len = 16; len <= MAXSIZE; len *= 4) {
+		printf("%9zu %10.2f", len, measure(unmaskBytes, data, len));
+		for (k = kernels; k->name != NULL; k++) {
+			if (!k->supported)
+				continue;
+			unmaskKernel = k->unmask;
+			printf(" %10.2f", measure(wsUnmask, data, len));
+		}
+		printf("\n");
+	}
+	free(buf);
+	free(copy);
+	return 0;
+}
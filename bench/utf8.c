@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The cost of validating text messages on receive.  The same payloads are
+ * read through wsRead() in binary frames, which are only unmasked, and in
+ * text frames, which are unmasked and validated in one pass.  Payloads are
+ * ASCII or mixed with three byte characters.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../websocket.c"
+#include "bench.h"
+
+#define VOLUME		(64 * 1024 * 1024)	/* bytes per measurement */
+#define RUNS		5			/* the fastest run counts */
+
+static uint8_t *input;
+static size_t inputlen, inputpos;
+
+static int
+readInput(void *arg, unsigned char *dest, size_t len)
+{
+	size_t n;
+
+	if ((n = inputlen - inputpos) == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (n > len)
+		n = len;
+	memcpy(dest, input + inputpos, n);
+	inputpos += n;
+	return n;
+}
+
+static int
+writeOutput(void *arg, unsigned char *data, size_t len)
+{
+	return len;
+}
+
+static size_t
+putFrame(uint8_t *out, enum wsFrameType type, const uint8_t *data,
+    size_t len)
+{
+	static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	size_t hlen, n;
+
+	hlen = wsMakeFrameHeader(len, out, type);
+	out[1] |= 0x80;
+	memcpy(out + hlen, key, sizeof(key));
+	hlen += sizeof(key);
+	for (n = 0; n < len; n++)
+		out[hlen + n] = data[n] ^ key[n & 3];
+	return hlen + len;
+}
+
+/* Seconds to read all frames, the best of RUNS */
+static double
+readAll(const uint8_t *frames, size_t len, size_t count,
+    enum wsFrameType type)
+{
+	struct wsReader reader;
+	double start, elapsed, best;
+	size_t n, msglen;
+	char *msg;
+	int run;
+
+	best = 0;
+	for (run = 0; run < RUNS; run++) {
+		memcpy(input, frames, len);
+		inputlen = len;
+		inputpos = 0;
+		nullReader(&reader);
+		start = bench_now();
+		for (n = 0; wsRead(&reader, &msg, &msglen, readInput,
+		    writeOutput, NULL) == type; n++)
+			;
+		elapsed = bench_now() - start;
+		freeReader(&reader);
+		if (n != count) {
+			printf("%zu of %zu messages read\n", n, count);
+			exit(1);
+		}
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+static void
+measure(size_t size, int mixed)
+{
+	uint8_t *payload, *binary, *text;
+	size_t n, count, binlen, textlen;
+	double tbin, ttext;
+
+	payload = malloc(size);
+	for (n = 0; n < size; ) {
+		if (mixed && n % 7 == 0 && n + 3 <= size) {
+			payload[n++] = 0xe2;	/* the euro sign */
+			payload[n++] = 0x82;
+			payload[n++] = 0xac;
+		} else {
+			payload[n] = 'a' + n % 26;
+			n++;
+		}
+	}
+	count = VOLUME / (size + WS_MAX_HEADER + 4);
+	binary = malloc(count * (size + WS_MAX_HEADER + 4));
+	text = malloc(count * (size + WS_MAX_HEADER + 4));
+	input = malloc(count * (size + WS_MAX_HEADER + 4));
+	for (binlen = textlen = 0, n = 0; n < count; n++) {
+		binlen += putFrame(binary + binlen, WS_BINARY_FRAME, payload,
+		    size);
+		textlen += putFrame(text + textlen, WS_TEXT_FRAME, payload,
+		    size);
+	}
+
+	tbin = readAll(binary, binlen, count, WS_BINARY_FRAME);
+	ttext = readAll(text, textlen, count, WS_TEXT_FRAME);
+	printf("%9zu %6s %10.2f %10.2f %+9.1f%%\n", size,
+	    mixed ? "mixed" : "ascii", binlen / tbin / 1e9,
+	    textlen / ttext / 1e9, (ttext / tbin - 1) * 100);
+	free(payload);
+	free(binary);
+	free(text);
+	free(input);
+}
+
+static const char *
+kernelName(void)
+{
+#ifdef WS_HAVE_X86_SIMD
+	if (utf8Kernel == utf8AVX2)
+		return "avx2";
+	if (utf8Kernel == utf8SSE41)
+		return "sse4.1";
+#endif
+	return "word";
+}
+
+int
+main(void)
+{
+	static const size_t sizes[] = { 64, 1024, 16384, 65536, 1048576 };
+	size_t n;
+
+	initKernels();
+	printf("receive throughput in GB/s, %s kernel\n", kernelName());
+	printf("%9s %6s %10s %10s %10s\n", "message", "text", "binary",
+	    "validated", "overhead");
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		measure(sizes[n], 0);
+		measure(sizes[n], 1);
+	}
+	return 0;
+}
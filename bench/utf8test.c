@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Check the unmask and validate kernels against utf8Scalar().  Sequences of
+ * four bytes at the limits of the ranges in the state machine are placed
+ * across the 16, 32 and 64 byte blocks of the vector kernels, between ASCII
+ * and between two byte characters, in buffers that end after them or
+ * continue.  Random text, valid or damaged, is then split into fragments
+ * that wsUnmaskUTF8() validates one after the other.  Exits with 1 on a
+ * mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../websocket.c"
+#include "bench.h"
+
+#define BUFLEN		96
+#define MSGLEN		4096
+#define MESSAGES	200000
+
+static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+static const uint8_t pattern[8] = {
+	0x12, 0x34, 0x56, 0x78, 0x12, 0x34, 0x56, 0x78
+};
+
+static const uint8_t limits[] = {
+	0x00, 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf, 0xc0, 0xc1, 0xc2,
+	0xdf, 0xe0, 0xe1, 0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf3, 0xf4,
+	0xf5, 0xff
+};
+#define NLIMITS		(sizeof(limits) / sizeof(limits[0]))
+
+/* Sequences start up to three bytes before a block and at its start */
+static const size_t positions[] = {
+	13, 14, 15, 16, 29, 30, 31, 32, 61, 62, 63, 64
+};
+#define NPOSITIONS	(sizeof(positions) / sizeof(positions[0]))
+
+static struct kernel {
+	const char	*name;
+	uint32_t	(*validate)(uint8_t *, size_t, const uint8_t *,
+			    uint32_t);
+	int		 supported;
+} kernels[] = {
+	{ "word",	utf8Word,	1 },
+#ifdef WS_HAVE_X86_SIMD
+	{ "sse4.1",	utf8SSE41,	0 },
+	{ "avx2",	utf8AVX2,	0 },
+#endif
+	{ NULL,		NULL,		0 }
+};
+
+static int failures;
+
+static void
+report(struct kernel *k, const uint8_t *plain, size_t len, size_t pos,
+    uint32_t got, uint32_t want)
+{
+	size_t n;
+
+	if (failures++ >= 10)
+		return;
+	printf("%s: length %zu at %zu: state %x, expected %x:", k->name, len,
+	    pos, got, want);
+	for (n = pos; n < pos + 4 && n < len; n++)
+		printf(" %02x", plain[n]);
+	printf("\n");
+}
+
+/* Run a kernel on the masked text, unaligned like a payload */
+static void
+check(struct kernel *k, const uint8_t *plain, size_t len, size_t pos)
+{
+	uint8_t buf[BUFLEN + 1];
+	uint32_t want, got;
+	size_t n;
+
+	for (n = 0; n < len; n++)
+		buf[1 + n] = plain[n] ^ key[n & 3];
+	want = utf8Scalar(WS_UTF8_ACCEPT, plain, len);
+	got = k->validate(buf + 1, len, pattern, WS_UTF8_ACCEPT);
+	if (got != want || (got != WS_UTF8_REJECT &&
+	    memcmp(buf + 1, plain, len)))
+		report(k, plain, len, pos, got, want);
+}
+
+static void
+checkBoundaries(struct kernel *k)
+{
+	uint8_t plain[BUFLEN];
+	size_t a, b, c, d, p, n, pos;
+	int fill;
+
+	for (fill = 0; fill < 2; fill++) {
+		for (n = 0; n < BUFLEN; n++)
+			plain[n] = fill == 0 ? 'a' : n & 1 ? 0xa9 : 0xc3;
+		for (p = 0; p < NPOSITIONS; p++) {
+			pos = positions[p];
+			for (a = 0; a < NLIMITS; a++)
+			for (b = 0; b < NLIMITS; b++)
+			for (c = 0; c < NLIMITS; c++)
+			for (d = 0; d < NLIMITS; d++) {
+				plain[pos] = limits[a];
+				plain[pos + 1] = limits[b];
+				plain[pos + 2] = limits[c];
+				plain[pos + 3] = limits[d];
+				check(k, plain, BUFLEN, pos);
+				check(k, plain, pos + 4, pos);
+			}
+			memcpy(plain + pos, fill == 0 ? "aaaa" : "\xc3\xa9\xc3\xa9",
+			    4);
+		}
+	}
+}
+
+/* Random text with characters of all lengths, sometimes damaged */
+static size_t
+randomText(uint8_t *buf, size_t size)
+{
+	uint32_t cp, r;
+	size_t n, len;
+
+	len = bench_random() % (bench_random() % 10 ? 300 : size - 4);
+	for (n = 0; n < len; ) {
+		r = bench_random() % 100;
+		if (r < 60)
+			cp = bench_random() % 0x80;
+		else if (r < 75)
+			cp = 0x80 + bench_random() % (0x800 - 0x80);
+		else if (r < 90)
+			cp = 0x800 + bench_random() % (0x10000 - 0x800);
+		else
+			cp = 0x10000 + bench_random() % (0x110000 - 0x10000);
+		if (cp >= 0xd800 && cp <= 0xdfff)
+			cp = 'a';
+		if (cp < 0x80)
+			buf[n++] = cp;
+		else if (cp < 0x800) {
+			buf[n++] = 0xc0 | cp >> 6;
+			buf[n++] = 0x80 | (cp & 0x3f);
+		} else if (cp < 0x10000) {
+			buf[n++] = 0xe0 | cp >> 12;
+			buf[n++] = 0x80 | (cp >> 6 & 0x3f);
+			buf[n++] = 0x80 | (cp & 0x3f);
+		} else {
+			buf[n++] = 0xf0 | cp >> 18;
+			buf[n++] = 0x80 | (cp >> 12 & 0x3f);
+			buf[n++] = 0x80 | (cp >> 6 & 0x3f);
+			buf[n++] = 0x80 | (cp & 0x3f);
+		}
+	}
+	switch (bench_random() % 4) {
+	case 0:		/* random bytes */
+		for (r = bench_random() % 4; r > 0 && n > 0; r--)
+			buf[bench_random() % n] = bench_random();
+		break;
+	case 1:		/* a continuation byte */
+		if (n > 0)
+			buf[bench_random() % n] = 0x80 | bench_random() % 0x40;
+		break;
+	case 2:		/* possibly the last character cut */
+		if (n > 0)
+			n -= bench_random() % 2;
+		break;
+	}
+	return n;
+}
+
+static void
+checkFragments(struct kernel *k)
+{
+	uint8_t plain[MSGLEN], buf[MSGLEN + 32];
+	uint32_t want, state;
+	size_t len, off, n, flen, align;
+	int m;
+
+	utf8Kernel = k->validate;
+	for (m = 0; m < MESSAGES; m++) {
+		len = randomText(plain, sizeof(plain));
+		want = utf8Scalar(WS_UTF8_ACCEPT, plain, len);
+		state = WS_UTF8_ACCEPT;
+		for (off = 0; off < len && state != WS_UTF8_REJECT;
+		    off += flen) {
+			flen = len - off;
+			if (bench_random() % 2)
+				flen = 1 + bench_random() % flen;
+			align = bench_random() % 32;
+			for (n = 0; n < flen; n++)
+				buf[align + n] = plain[off + n] ^ key[n & 3];
+			state = wsUnmaskUTF8(buf + align, flen, key, state);
+			if (state != WS_UTF8_REJECT &&
+			    memcmp(buf + align, plain + off, flen))
+				state = ~want;
+		}
+		if (state != want)
+			report(k, plain, len, off, state, want);
+	}
+}
+
+int
+main(void)
+{
+	struct kernel *k;
+
+	initKernels();
+#ifdef WS_HAVE_X86_SIMD
+	kernels[1].supported = __builtin_cpu_supports("sse4.1");
+	kernels[2].supported = __builtin_cpu_supports("avx2");
+#endif
+	for (k = kernels; k->name != NULL; k++) {
+		if (!k->supported) {
+			printf("%-8s not supported\n", k->name);
+			continue;
+		}
+		checkBoundaries(k);
+		checkFragments(k);
+		printf("%-8s %s\n", k->name, failures ? "failed" : "ok");
+		if (failures)
+			return 1;
+	}
+	return 0;
+}
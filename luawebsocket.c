@@ -28,25 +28,261 @@
 /* WebSocket for Lua */
 
 #include <sys/types.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <linux/filter.h>
+#endif
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include "websocket.h"
+#include "uring.h"
+#include "wheel.h"
 
 #include "luawebsocket.h"
 
-#include "websocket.h"
+/* Maximum payload of a TLS record, small writes are coalesced up to this */
+#define TLS_RECORD_SIZE	16384
+
+/* Corked output is flushed once this much has been buffered */
+#define CORK_MAX	(256 * 1024)
+
+/* Messages framed on the stack by sendv, more use a temporary userdata */
+#define SENDV_STACK	32
+
+/* Default high watermark of output queues, frames written per writev() */
+#define QUEUE_HIGH	(1024 * 1024)
+#define QUEUE_IOV	64
+
+/* Default number of events returned by one poller:wait() call */
+#define POLLER_MAXEVENTS	256
+
+/* Defaults of an io_uring poller: queue size, receive buffers and size */
+#define URING_ENTRIES		256
+#define URING_BUFFERS		128
+#define URING_BUFSIZE		16384
+
+/* The request of a connection a completion is for, in the low bits */
+#define URING_POLLIN		1
+#define URING_POLLOUT		2
+#define URING_RECV		3
+#define URING_ACCEPT		4
+#define URING_TAGMASK		7
+
+/* Milliseconds per tick of the keepalive timer wheel */
+#define KEEPALIVE_TICK		100
+
+/* Seconds between checks whether the ticket key file was replaced */
+#define TICKET_CHECK		60
+
+/* SSL_CTX ex_data index of the TLSDATA of a listener */
+static int tlsdata_index = -1;
+
+#if LUA_VERSION_NUM < 503
+/* Lua 5.2 can not yield across C calls with a continuation */
+typedef int lua_KContext;
+typedef int (*lua_KFunction)(lua_State *, int, lua_KContext);
+#define lua_isyieldable(L)	0
+#endif
+
+/*
+ * Operations on a non-blocking connection that would block suspend the
+ * calling coroutine instead.  It yields the connection and "r" or "w",
+ * whoever resumes it (e.g. poller:run()) has to do so once the connection
+ * is ready.  The operation then continues where it left off.
+ */
+#define websocket_canyield(L, websock) \
+	((websock)->nonblocking && lua_isyieldable(L))
+
+static int
+websocket_yield(lua_State *L, int idx, const char *mode, lua_KContext ctx,
+    lua_KFunction k)
+{
+	lua_pushvalue(L, idx);
+	lua_pushstring(L, mode);
+#if LUA_VERSION_NUM >= 503
+	return lua_yieldk(L, 2, ctx, k);
+#else
+	return luaL_error(L, "yielding requires Lua 5.3 or newer");
+#endif
+}
+
+static int
+websocket_resume(lua_State *co, lua_State *from, int nargs, int *nres)
+{
+#if LUA_VERSION_NUM >= 504
+	return lua_resume(co, from, nargs, nres);
+#else
+	int status;
+
+	status = lua_resume(co, from, nargs);
+	*nres = lua_gettop(co);
+	return status;
+#endif
+}
+
+static int
+websocket_setnonblocking(int fd, int nonblocking)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		return -1;
+	if (nonblocking)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+	return fcntl(fd, F_SETFL, flags);
+}
+
+/* Wait until a non-blocking socket is ready */
+static int
+websocket_wait(WEBSOCKET *websock, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = websock->socket;
+	pfd.events = events;
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+
+/*
+ * Returns 0 when all data has been written, -1 on error and 1 if wait is not
+ * set and the write would block.  A write that would block must be retried
+ * with the same data.
+ */
+static int
+websocket_sslwrite(WEBSOCKET *websock, const void *data, size_t len, int wait)
+{
+	int ret, error;
+
+	while ((ret = SSL_write(websock->ssl, data, len)) <= 0) {
+		switch (error = SSL_get_error(websock->ssl, ret)) {
+		case SSL_ERROR_WANT_WRITE:
+			if (!wait)
+				return 1;
+			if (websocket_wait(websock, POLLOUT))
+				return -1;
+			break;
+		case SSL_ERROR_WANT_READ:
+			if (!wait)
+				return 1;
+			if (websocket_wait(websock, POLLIN))
+				return -1;
+			break;
+		default:
+			/* Only a failed system call sets errno */
+			if (error != SSL_ERROR_SYSCALL)
+				errno = EPROTO;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int websocket_accept(lua_State *);
+static int websocket_sslaccept(lua_State *);
+#ifdef __linux__
+static int websocket_poolaccept(lua_State *, WEBSOCKET *);
+#endif
+
+static int
+websocket_acceptk(lua_State *L, int status, lua_KContext ctx)
+{
+	lua_settop(L, ctx);
+	return websocket_accept(L);
+}
+
+static int
+websocket_sslacceptk(lua_State *L, int status, lua_KContext ctx)
+{
+	lua_settop(L, ctx);
+	return websocket_sslaccept(L);
+}
+
+/* Note how the records of a connection are handled, count the handshake */
+static void
+websocket_tlsdone(WEBSOCKET *acc)
+{
+	TLSDATA *tls;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/* OpenSSL falls back to user space if the kernel or cipher can't */
+	acc->ktlstx = BIO_get_ktls_send(SSL_get_wbio(acc->ssl)) == 1;
+	acc->ktlsrx = BIO_get_ktls_recv(SSL_get_rbio(acc->ssl)) == 1;
+#endif
+	if ((tls = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(acc->ssl),
+	    tlsdata_index)) != NULL) {
+		if (SSL_session_reused(acc->ssl))
+			tls->resumed++;
+		else
+			tls->full++;
+		if (acc->ktlstx)
+			tls->ktls++;
+	}
+}
+
+/* Complete the TLS handshake of the connection at index 2 */
+static int
+websocket_sslaccept(lua_State *L)
+{
+	WEBSOCKET *acc;
+	int ret, error;
 
-#define BUFSIZE		65535
+	acc = luaL_checkudata(L, 2, WEBSOCKET_METATABLE);
+	while ((ret = SSL_accept(acc->ssl)) <= 0) {
+		switch (error = SSL_get_error(acc->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			if (websocket_canyield(L, acc))
+				return websocket_yield(L, 2,
+				    error == SSL_ERROR_WANT_READ ? "r" : "w",
+				    2, websocket_sslacceptk);
+			if (websocket_wait(acc, error == SSL_ERROR_WANT_READ ?
+			    POLLIN : POLLOUT))
+				return luaL_error(L, "can't accept SSL "
+				    "connection");
+			break;
+		default:
+			return luaL_error(L, "can't accept SSL connection: "
+			    "SSL error code %d", error);
+		}
+	}
+	websocket_tlsdone(acc);
+	lua_settop(L, 2);
+	return 1;
+}
 
 static int
 websocket_accept(lua_State *L)
@@ -54,22 +290,66 @@ websocket_accept(lua_State *L)
 	WEBSOCKET *websock;
 	struct sockaddr_storage addr;
 	socklen_t len = sizeof(addr);
-	int socket, ret;
+	int socket, nargs;
 
 	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	nargs = lua_gettop(L);
+#ifdef __linux__
+	if (websock->pool != NULL)
+		return websocket_poolaccept(L, websock);
+
+	/* New connections are accepted by the io_uring poller */
+	if (websock->uconn != NULL && websock->uconn->listener) {
+		URINGCONN *u = websock->uconn;
+
+		if (u->nfds > 0) {
+			socket = u->fds[0];
+			memmove(u->fds, u->fds + 1, --u->nfds * sizeof(int));
+		} else {
+			socket = -1;
+			errno = EAGAIN;
+		}
+	} else
+#endif
 	socket = accept(websock->socket, (struct sockaddr *)&addr, &len);
 
 	if (socket == -1) {
+		if (websock->nonblocking && (errno == EAGAIN ||
+		    errno == EWOULDBLOCK || errno == ECONNABORTED)) {
+			if (websocket_canyield(L, websock))
+				return websocket_yield(L, 1, "r", nargs,
+				    websocket_acceptk);
+			lua_pushboolean(L, 0);
+			return 1;
+		}
 		return luaL_error(L, "error accepting connection");
 	} else {
 		WEBSOCKET *acc;
 
+		lua_settop(L, 1);
 		acc = lua_newuserdata(L, sizeof(WEBSOCKET));
 		memset(acc, 0, sizeof(WEBSOCKET));
 		luaL_getmetatable(L, WEBSOCKET_METATABLE);
 		lua_setmetatable(L, -2);
 
 		acc->socket = socket;
+		nullReader(&acc->reader);
+		nullHandshake(&acc->handshake);
+		nullDeflater(&acc->deflater);
+		acc->reader.maxMessageSize = websock->reader.maxMessageSize;
+		acc->deflate = websock->deflate;
+		acc->queueing = websock->queueing;
+		acc->qhigh = websock->qhigh;
+		acc->qlow = websock->qlow;
+		acc->qdrop = websock->qdrop;
+
+		/* Connections inherit the mode of the listening socket */
+		if (websock->nonblocking) {
+			if (websocket_setnonblocking(socket, 1))
+				return luaL_error(L, "can't set non-blocking "
+				    "mode");
+			acc->nonblocking = 1;
+		}
 
 		if (websock->ctx != NULL) {
 			if ((acc->ssl = SSL_new(websock->ctx)) == NULL)
@@ -78,12 +358,352 @@ websocket_accept(lua_State *L)
 
 			if (!SSL_set_fd(acc->ssl, socket))
 				return luaL_error(L, "can't set SSL socket");
-			if ((ret = SSL_accept(acc->ssl)) <= 0)
-				return luaL_error(L, "can't accept SSL "
-				    "connection: SSL error code %d",
-				    SSL_get_error(acc->ssl, ret));
+			SSL_set_mode(acc->ssl,
+			    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+			return websocket_sslaccept(L);
+		}
+	}
+	return 1;
+}
+
+/* Return an optional integer field of the bind options table */
+static int
+websocket_optint(lua_State *L, int opts, const char *name, int def)
+{
+	int value;
+
+	if (opts == 0)
+		return def;
+	lua_getfield(L, opts, name);
+	value = lua_isnil(L, -1) ? def : (int)luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+/* Return an optional boolean field of the bind options table */
+static int
+websocket_optbool(lua_State *L, int opts, const char *name)
+{
+	int value;
+
+	if (opts == 0)
+		return 0;
+	lua_getfield(L, opts, name);
+	value = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+/*
+ * Apply the socket options requested in the bind options table.  With
+ * reuseport, each process or Lua state binding the same address gets an
+ * accept queue of its own and the kernel balances connections between them.
+ * cpu prefers the listener for connections whose packets are processed on
+ * that CPU, steering does the same for the whole group with a BPF program
+ * that selects the listener by the index of the receiving CPU, which
+ * requires that the n-th listener of the group is bound by the worker
+ * running on CPU n.
+ */
+static int
+websocket_sockopts(lua_State *L, int fd, int opts)
+{
+	int optval, cpu;
+
+	optval = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+
+	if (websocket_optbool(L, opts, "reuseport")) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval,
+		    sizeof optval))
+			return -1;
+#else
+		errno = EOPNOTSUPP;
+		return -1;
+#endif
+	}
+
+	if ((cpu = websocket_optint(L, opts, "cpu", -1)) >= 0) {
+#ifdef SO_INCOMING_CPU
+		if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+		    sizeof cpu))
+			return -1;
+#else
+		errno = EOPNOTSUPP;
+		return -1;
+#endif
+	}
+
+	if (websocket_optbool(L, opts, "steering")) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+		struct sock_filter code[] = {
+			/* A = raw_smp_processor_id() */
+			{ BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			    SKF_AD_OFF + SKF_AD_CPU },
+			/* return A */
+			{ BPF_RET | BPF_A, 0, 0, 0 }
+		};
+		struct sock_fprog prog = {
+			.len = sizeof(code) / sizeof(code[0]),
+			.filter = code
+		};
+
+		if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		    &prog, sizeof prog))
+			return -1;
+#else
+		errno = EOPNOTSUPP;
+		return -1;
+#endif
+	}
+	return 0;
+}
+
+/*
+ * Read the session ticket keys, a file of one to TICKET_MAXKEYS keys of 80
+ * bytes each.  To rotate the keys, a new file with the new key first and
+ * the previous keys after it is moved in place; worker processes pick it up
+ * within TICKET_CHECK seconds.
+ */
+static int
+tlsdata_load(TLSDATA *tls)
+{
+	TICKETKEY keys[TICKET_MAXKEYS];
+	struct stat st;
+	ssize_t nread;
+	int fd;
+
+	if ((fd = open(tls->keyfile, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	if (fstat(fd, &st) || (nread = read(fd, keys, sizeof(keys))) <= 0 ||
+	    nread % sizeof(TICKETKEY) != 0 || nread != st.st_size) {
+		close(fd);
+		OPENSSL_cleanse(keys, sizeof(keys));
+		return -1;
+	}
+	close(fd);
+	memcpy(tls->keys, keys, nread);
+	OPENSSL_cleanse(keys, sizeof(keys));
+	tls->nkeys = nread / sizeof(TICKETKEY);
+	tls->keymtime = st.st_mtime;
+	tls->keychecked = time(NULL);
+	return 0;
+}
+
+/* Reload the ticket keys if the file changed, keep the old ones on errors */
+static void
+tlsdata_reload(TLSDATA *tls)
+{
+	struct stat st;
+	time_t now;
+
+	now = time(NULL);
+	if (tls->keyfile == NULL || now - tls->keychecked < TICKET_CHECK)
+		return;
+	tls->keychecked = now;
+	if (stat(tls->keyfile, &st) == 0 && st.st_mtime != tls->keymtime)
+		tlsdata_load(tls);
+}
+
+static void
+tlsdata_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl,
+    void *argp)
+{
+	TLSDATA *tls = ptr;
+
+	if (tls == NULL)
+		return;
+	free(tls->keyfile);
+	OPENSSL_cleanse(tls->keys, sizeof(tls->keys));
+	pthread_mutex_destroy(&tls->lock);
+	free(tls);
+}
+
+/*
+ * Encrypt a new session ticket with the first key or find the key to
+ * decrypt one with.  Tickets encrypted with an older key are renewed.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+websocket_ticketkey(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int
+websocket_ticketkey(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	TLSDATA *tls;
+	TICKETKEY key;
+	int n, ret;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+#endif
+
+	tls = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tlsdata_index);
+	if (tls == NULL)
+		return 0;
+
+	/* Handshakes may run in the threads of a pool, work on a copy */
+	pthread_mutex_lock(&tls->lock);
+	tlsdata_reload(tls);
+	if (enc)
+		n = 0;
+	else
+		for (n = 0; n < tls->nkeys; n++)
+			if (!memcmp(name, tls->keys[n].name,
+			    sizeof(tls->keys[n].name)))
+				break;
+	if (n < tls->nkeys)
+		key = tls->keys[n];
+	ret = n < tls->nkeys;
+	pthread_mutex_unlock(&tls->lock);
+	if (!ret)
+		return 0;
+
+	ret = -1;
+	if (enc) {
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			goto done;
+		memcpy(name, key.name, sizeof(key.name));
+		if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL,
+		    key.aes, iv))
+			goto done;
+	} else if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL,
+	    key.aes, iv))
+		goto done;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	    key.hmac, sizeof(key.hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    "sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (!EVP_MAC_CTX_set_params(hctx, params))
+		goto done;
+#else
+	if (!HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(),
+	    NULL))
+		goto done;
+#endif
+	ret = enc || n == 0 ? 1 : 2;
+done:
+	OPENSSL_cleanse(&key, sizeof(key));
+	return ret;
+}
+
+/*
+ * Set up session resumption for a secure listener.  The server side
+ * session cache holds sessioncache sessions (0 disables it) for
+ * sessiontimeout seconds.  Session tickets are encrypted with the keys in
+ * the file ticketkeys, so they are accepted by all worker processes that
+ * share the file, or with keys OpenSSL generates for this process if no
+ * file is given.  tickets = false disables session tickets.  ktls = true
+ * lets the kernel encrypt and decrypt records where it supports the
+ * negotiated cipher.
+ */
+static int
+websocket_tlsopts(lua_State *L, SSL_CTX *ctx, int opts)
+{
+	static const unsigned char sid_ctx[] = "luawebsocket";
+	TLSDATA *tls;
+	const char *keyfile;
+	int size, timeout;
+
+	if ((tls = calloc(1, sizeof(TLSDATA))) == NULL)
+		return luaL_error(L, "memory error");
+	pthread_mutex_init(&tls->lock, NULL);
+	if (!SSL_CTX_set_ex_data(ctx, tlsdata_index, tls)) {
+		pthread_mutex_destroy(&tls->lock);
+		free(tls);
+		return luaL_error(L, "can't attach TLS data");
+	}
+
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	if ((size = websocket_optint(L, opts, "sessioncache", -1)) == 0)
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		if (size > 0)
+			SSL_CTX_sess_set_cache_size(ctx, size);
+	}
+	if ((timeout = websocket_optint(L, opts, "sessiontimeout", 0)) > 0)
+		SSL_CTX_set_timeout(ctx, timeout);
+
+	if (websocket_optbool(L, opts, "ktls")) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	}
+
+	if (opts != 0) {
+		lua_getfield(L, opts, "tickets");
+		if (!lua_isnil(L, -1) && !lua_toboolean(L, -1))
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		lua_pop(L, 1);
+
+		lua_getfield(L, opts, "ticketkeys");
+		keyfile = lua_tostring(L, -1);
+		if (keyfile != NULL) {
+			if ((tls->keyfile = strdup(keyfile)) == NULL)
+				return luaL_error(L, "memory error");
+			if (tlsdata_load(tls))
+				return luaL_error(L, "can't load ticket keys "
+				    "from %s", keyfile);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx,
+			    websocket_ticketkey);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx,
+			    websocket_ticketkey);
+#endif
 		}
+		lua_pop(L, 1);
 	}
+	return 0;
+}
+
+/*
+ * Return the number of full and of resumed TLS handshakes of a listener and
+ * the number of connections that send with kernel TLS.
+ */
+static int
+websocket_tlsstats(lua_State *L)
+{
+	WEBSOCKET *websock;
+	TLSDATA *tls;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	if (websock->ctx == NULL || (tls = SSL_CTX_get_ex_data(websock->ctx,
+	    tlsdata_index)) == NULL)
+		return 0;
+	lua_pushinteger(L, tls->full);
+	lua_pushinteger(L, tls->resumed);
+	lua_pushinteger(L, tls->ktls);
+	return 3;
+}
+
+/*
+ * Return how records of a connection are handled: "plain" without TLS,
+ * "user" if OpenSSL handles them, "ktls" if the kernel does, "ktls-tx" or
+ * "ktls-rx" if it does so in one direction only.
+ */
+static int
+websocket_tlsmode(lua_State *L)
+{
+	WEBSOCKET *websock;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	if (websock->ssl == NULL)
+		lua_pushliteral(L, "plain");
+	else if (websock->ktlstx && websock->ktlsrx)
+		lua_pushliteral(L, "ktls");
+	else if (websock->ktlstx)
+		lua_pushliteral(L, "ktls-tx");
+	else if (websock->ktlsrx)
+		lua_pushliteral(L, "ktls-rx");
+	else
+		lua_pushliteral(L, "user");
 	return 1;
 }
 
@@ -91,20 +711,28 @@ static int
 websocket_bind(lua_State *L)
 {
 	struct addrinfo hints, *res, *res0;
-	int fd, error, optval;
+	int fd, error, opts, backlog;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
 	const char *port, *host, *cert;
 	WEBSOCKET *websock;
 
-	cert = NULL;
+	host = luaL_checkstring(L, 1);
+	port = luaL_checkstring(L, 2);
 
-	switch (lua_gettop(L)) {
-	case 3:
-		cert = luaL_checkstring(L, 3);
-	default:
-		host = luaL_checkstring(L, 1);
-		port = luaL_checkstring(L, 2);
+	/* websocket.bind(host, port [, cert] [, options]) */
+	cert = NULL;
+	opts = 0;
+	if (lua_istable(L, 3))
+		opts = 3;
+	else {
+		if (!lua_isnoneornil(L, 3))
+			cert = luaL_checkstring(L, 3);
+		if (!lua_isnoneornil(L, 4)) {
+			luaL_checktype(L, 4, LUA_TTABLE);
+			opts = 4;
+		}
 	}
+	backlog = websocket_optint(L, opts, "backlog", SOMAXCONN);
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_socktype = SOCK_STREAM;
@@ -121,9 +749,13 @@ websocket_bind(lua_State *L)
 		    res->ai_protocol);
 		if (fd < 0)
 			continue;
-		optval = 1;
-		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval,
-		    sizeof optval);
+		if (websocket_sockopts(L, fd, opts)) {
+			error = errno;
+			close(fd);
+			freeaddrinfo(res0);
+			return luaL_error(L, "can't set socket options: %s",
+			    strerror(error));
+		}
 		if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
 			close(fd);
 			fd = -1;
@@ -131,18 +763,28 @@ websocket_bind(lua_State *L)
 		}
 		break;
 	}
+	freeaddrinfo(res0);
 
 	if (fd < 0)
 		return luaL_error(L, "connection error");
 
-	if (listen(fd, lua_gettop(L) > 1 ? luaL_checkinteger(L, 2) : 32))
+	if (listen(fd, backlog)) {
+		close(fd);
 		return luaL_error(L, "listen error");
+	}
 
 	/* XXX seed_prng(); */
 	websock = lua_newuserdata(L, sizeof(WEBSOCKET));
 	memset(websock, 0, sizeof(WEBSOCKET));
 
 	websock->socket = fd;
+	nullReader(&websock->reader);
+	nullHandshake(&websock->handshake);
+	nullDeflater(&websock->deflater);
+
+	/* Closed by the garbage collector if setting up TLS fails */
+	luaL_getmetatable(L, WEBSOCKET_METATABLE);
+	lua_setmetatable(L, -2);
 
 	if (cert != NULL) {
 		SSL_library_init();
@@ -155,134 +797,3414 @@ websocket_bind(lua_State *L)
 		if (SSL_CTX_use_PrivateKey_file(websock->ctx, cert,
 		    SSL_FILETYPE_PEM) != 1)
 			return luaL_error(L, "error loading private key");
+		websocket_tlsopts(L, websock->ctx, opts);
 	}
-	luaL_getmetatable(L, WEBSOCKET_METATABLE);
-	lua_setmetatable(L, -2);
 	return 1;
 }
 
+/* Advance a vector of buffers by len bytes */
 static int
-websocket_handshake(lua_State *L)
+websocket_iovadvance(struct iovec **iovp, int iovcnt, size_t len)
 {
-	struct handshake hs;
-	size_t nread;
-	WEBSOCKET *websock;
-	char *buf;
+	struct iovec *iov = *iovp;
 
-	nullHandshake(&hs);
-	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	while (iovcnt > 0 && len >= iov->iov_len) {
+		len -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	}
+	if (iovcnt > 0) {
+		iov->iov_base = (char *)iov->iov_base + len;
+		iov->iov_len -= len;
+	}
+	*iovp = iov;
+	return iovcnt;
+}
 
-	buf = malloc(BUFSIZE);
-	if (websock->ssl)
-		nread = SSL_read(websock->ssl, buf, BUFSIZE);
-	else
-		nread = recv(websock->socket, buf, BUFSIZE, 0);
-	buf[nread] = '\0';
-
-	if (wsParseHandshake((unsigned char *)buf, nread, &hs) ==
-	    WS_OPENING_FRAME) {
-		if (!strcmp(hs.resource, luaL_checkstring(L, 2))) {
-			wsGetHandshakeAnswer(&hs, (unsigned char *)buf, &nread);
-			freeHandshake(&hs);
-			if (websock->ssl)
-				SSL_write(websock->ssl, buf, nread);
-			else
-				send(websock->socket, buf, nread, 0);
-			buf[nread] = '\0';
-			lua_pushboolean(L, 1);
-		} else {
-			nread = sprintf(buf, "HTTP/1.1 404 Not Found\r\n\r\n");
-			if (websock->ssl)
-				SSL_write(websock->ssl, buf, nread);
-			else
-				send(websock->socket, buf, nread, 0);
-			lua_pushnil(L);
+static int queue_copy(WEBSOCKET *, struct iovec *, int, lua_Integer);
+
+/*
+ * Write out a vector of buffers.  Plain sockets use writev(), for TLS the
+ * buffers are coalesced on the stack into records of up to TLS_RECORD_SIZE
+ * bytes, larger buffers are passed to SSL_write() directly.
+ *
+ * Non-blocking sockets are waited on until everything has been written if
+ * wait is set.  Otherwise, when the socket would block, what is left is
+ * copied to the output queue, which must be empty, and 1 is returned.  A
+ * TLS record that could not be written is retried from there with the
+ * same data.
+ */
+static int
+websocket_writev(WEBSOCKET *websock, struct iovec *iov, int iovcnt, int wait)
+{
+	unsigned char record[TLS_RECORD_SIZE];
+	struct iovec part[2];
+	size_t len, n, inflight;
+	ssize_t nwritten;
+	char *p;
+	int nparts, ret;
+
+	/* With kernel TLS the socket is written like a plain one */
+	if (websock->ssl && !websock->ktlstx) {
+		len = 0;
+		for (; iovcnt > 0; iov++, iovcnt--) {
+			p = iov->iov_base;
+			n = iov->iov_len;
+			while (n > 0) {
+				size_t chunk = sizeof(record) - len;
+
+				if (len == 0 && n >= sizeof(record)) {
+					if ((ret = websocket_sslwrite(websock,
+					    p, n, wait))) {
+						inflight = n;
+						goto next;
+					}
+					break;
+				}
+				if (chunk > n)
+					chunk = n;
+				memcpy(record + len, p, chunk);
+				len += chunk;
+				p += chunk;
+				n -= chunk;
+				if (len == sizeof(record)) {
+					if ((ret = websocket_sslwrite(websock,
+					    record, len, wait))) {
+						inflight = len;
+						goto next;
+					}
+					len = 0;
+				}
+			}
 		}
-	} else {
-		nread = sprintf(buf,
-			"HTTP/1.1 400 Bad Request\r\n"
-			"%s%s\r\n\r\n",
-			versionField,
-			version);
-		if (websock->ssl)
-			SSL_write(websock->ssl, buf, nread);
-		else
-			send(websock->socket, buf, nread, 0);
-		lua_pushnil(L);
+		p = NULL;
+		n = 0;
+		if (len > 0 && (ret = websocket_sslwrite(websock, record, len,
+		    wait))) {
+			inflight = len;
+			goto suspend;
+		}
+		return 0;
 	}
-	free(buf);
+
+	len = n = inflight = 0;
+	p = NULL;
+	while (iovcnt > 0) {
+		nwritten = writev(websock->socket, iov,
+		    iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (nwritten == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ret = 1;
+				if (!wait)
+					goto suspend;
+				if (websocket_wait(websock, POLLOUT) == 0)
+					continue;
+			}
+			return -1;
+		}
+		iovcnt = websocket_iovadvance(&iov, iovcnt, nwritten);
+	}
+	return 0;
+
+next:
+	/* The rest of the current buffer is in p and n */
+	iov++;
+	iovcnt--;
+suspend:
+	if (ret == -1)
+		return -1;
+	nparts = 0;
+	if (len > 0) {
+		part[nparts].iov_base = record;
+		part[nparts++].iov_len = len;
+	}
+	if (n > 0) {
+		part[nparts].iov_base = p;
+		part[nparts++].iov_len = n;
+	}
+	if ((nparts > 0 && queue_copy(websock, part, nparts, 0) == -1) ||
+	    (iovcnt > 0 && queue_copy(websock, iov, iovcnt, 0) == -1))
+		return -1;
+	websock->qinflight = inflight;
 	return 1;
 }
 
-static int
-websocket_read(void *data, char *dest, size_t len)
+/* Frames are shared between connections and their output queues */
+static FRAME *
+frame_alloc(size_t len)
 {
-	WEBSOCKET *websock = (WEBSOCKET *)data;
+	FRAME *frame;
+
+	if ((frame = malloc(sizeof(FRAME) + len)) == NULL)
+		return NULL;
+	frame->refcount = 1;
+	frame->len = len;
+	frame->zlen = 0;
+	frame->zbits = 0;
+	return frame;
+}
+
+static void
+frame_unref(FRAME *frame)
+{
+	if (--frame->refcount == 0)
+		free(frame);
+}
+
+#ifdef __linux__
+static int poller_modify(POLLER *, WEBSOCKET *);
+static void keepalive_start(POLLER *, WEBSOCKET *);
+#endif
+
+/* Messages keep a connection from being closed as idle */
+static void
+websocket_active(WEBSOCKET *websock)
+{
+	if (websock->poller != NULL)
+		websock->lastmsg = websock->poller->wheel.now;
+}
+
+/* The socket has to be waited on for writing while frames are queued */
+static void
+queue_changed(WEBSOCKET *websock)
+{
+#ifdef __linux__
+	if (websock->poller != NULL &&
+	    !(websock->interest & EPOLLOUT) != (websock->qhead == NULL))
+		poller_modify(websock->poller, websock);
+#endif
+}
+
+/*
+ * Find the queued frame with a key that has not started to go out yet,
+ * prev is set to the frame before it.
+ */
+static OUTFRAME *
+queue_find(WEBSOCKET *websock, lua_Integer key, OUTFRAME **prev)
+{
+	OUTFRAME *of;
+	size_t pos;
+
+	*prev = NULL;
+	for (pos = 0, of = websock->qhead; of != NULL;
+	    pos += of->len, *prev = of, of = of->next)
+		if (of->key == key && pos >= websock->qoff + websock->qinflight)
+			return of;
+	return NULL;
+}
 
-	if (websock->ssl)
-		return SSL_read(websock->ssl, dest, len);
+static void
+queue_unlink(WEBSOCKET *websock, OUTFRAME *of, OUTFRAME *prev)
+{
+	if (prev != NULL)
+		prev->next = of->next;
 	else
-		return recv(websock->socket, dest, len, 0);
+		websock->qhead = of->next;
+	if (websock->qtail == of)
+		websock->qtail = prev;
+	websock->qlen -= of->len;
+	frame_unref(of->frame);
+	free(of);
 }
 
+/*
+ * Append a frame to the output queue of a connection, taking a reference.
+ * A frame with a key supersedes a queued frame with the same key, unless
+ * that one has started to go out.  It takes its place, except for a
+ * compressed variant: the messages behind may have been compressed with
+ * the connection's context, so it must not overtake them and goes to the
+ * end instead.  Returns 1 if a frame was superseded.
+ */
 static int
-websocket_write(void *data, char *dest, size_t len)
+queue_push(WEBSOCKET *websock, FRAME *frame, const unsigned char *data,
+    size_t len, lua_Integer key)
 {
-	WEBSOCKET *websock = (WEBSOCKET *)data;
+	OUTFRAME *of, *prev;
+	int superseded = 0;
 
-	if (websock->ssl)
-		return SSL_write(websock->ssl, dest, len);
+	if (key != 0 && (of = queue_find(websock, key, &prev)) != NULL) {
+		if (data == frame->data || of == websock->qtail) {
+			frame->refcount++;
+			frame_unref(of->frame);
+			websock->qlen = websock->qlen - of->len + len;
+			of->frame = frame;
+			of->data = data;
+			of->len = len;
+			return 1;
+		}
+		queue_unlink(websock, of, prev);
+		superseded = 1;
+	}
+	if ((of = malloc(sizeof(OUTFRAME))) == NULL)
+		return -1;
+	frame->refcount++;
+	of->next = NULL;
+	of->frame = frame;
+	of->data = data;
+	of->len = len;
+	of->key = key;
+	if (websock->qtail != NULL)
+		websock->qtail->next = of;
 	else
-		return send(websock->socket, dest, len, 0);
+		websock->qhead = of;
+	websock->qtail = of;
+	websock->qlen += len;
+	queue_changed(websock);
+	return superseded;
 }
 
+/* Queue a copy of a vector of buffers */
 static int
-websocket_recv(lua_State *L)
+queue_copy(WEBSOCKET *websock, struct iovec *iov, int iovcnt,
+    lua_Integer key)
 {
-	WEBSOCKET *websock;
-	char *buf;
+	FRAME *frame;
 	size_t len;
+	int n, ret;
 
-	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	for (len = 0, n = 0; n < iovcnt; n++)
+		len += iov[n].iov_len;
+	if ((frame = frame_alloc(len)) == NULL)
+		return -1;
+	for (len = 0, n = 0; n < iovcnt; n++) {
+		memcpy(frame->data + len, iov[n].iov_base, iov[n].iov_len);
+		len += iov[n].iov_len;
+	}
+	ret = queue_push(websock, frame, frame->data, len, key);
+	frame_unref(frame);
+	return ret;
+}
 
-	if (wsRead(&buf, &len, websocket_read, websocket_write, websock)) {
-		if (websock->ssl) {
-			SSL_shutdown(websock->ssl);
-			SSL_free(websock->ssl);
-			websock->ssl = NULL;
-		} else {
-			close(websock->socket);
-			websock->socket = -1;
+/* Remove len written bytes from the head of the queue */
+static void
+queue_advance(WEBSOCKET *websock, size_t len)
+{
+	OUTFRAME *of;
+
+	websock->qlen -= len;
+	websock->qwritten += len;
+	while (len > 0) {
+		of = websock->qhead;
+		if (len < of->len - websock->qoff) {
+			websock->qoff += len;
+			break;
 		}
-		lua_pushnil(L);
-	} else {
-		lua_pushlstring(L, (const char *)buf, len);
-		free(buf);
+		len -= of->len - websock->qoff;
+		websock->qoff = 0;
+		if ((websock->qhead = of->next) == NULL)
+			websock->qtail = NULL;
+		frame_unref(of->frame);
+		free(of);
 	}
-	return 1;
 }
 
+/*
+ * Write out the output queue.  Returns 0 when it is empty, -1 on errors and
+ * 1 if wait is not set and the socket would block.  Plain sockets write up
+ * to QUEUE_IOV frames with one writev().  For TLS, frames are coalesced
+ * into records as in websocket_writev(); a record that could not be
+ * written is remembered in qinflight, so it is retried with the same data
+ * even if more frames have been queued in the meantime.
+ */
+static int
+queue_flush(WEBSOCKET *websock, int wait)
+{
+	unsigned char record[TLS_RECORD_SIZE];
+	struct iovec iov[QUEUE_IOV];
+	const unsigned char *p;
+	OUTFRAME *of;
+	size_t len, n, off;
+	ssize_t nwritten;
+	int iovcnt, ret;
+
+	while (websock->qhead != NULL) {
+		of = websock->qhead;
+		off = websock->qoff;
+		if (websock->ssl && !websock->ktlstx) {
+			len = websock->qinflight;
+			if (len > sizeof(record) || (len == 0 &&
+			    of->len - off >= sizeof(record))) {
+				/* Large frames are passed as they are */
+				p = of->data + off;
+				if (len == 0)
+					len = of->len - off;
+			} else {
+				if (len == 0)
+					len = websock->qlen < sizeof(record) ?
+					    websock->qlen : sizeof(record);
+				for (n = 0; n < len; of = of->next, off = 0) {
+					size_t chunk = of->len - off;
+
+					if (chunk > len - n)
+						chunk = len - n;
+					memcpy(record + n, of->data + off,
+					    chunk);
+					n += chunk;
+				}
+				p = record;
+			}
+			if ((ret = websocket_sslwrite(websock, p, len,
+			    wait))) {
+				websock->qinflight = ret == 1 ? len : 0;
+				return ret;
+			}
+			websock->qinflight = 0;
+			queue_advance(websock, len);
+			continue;
+		}
+
+		for (iovcnt = 0; of != NULL && iovcnt < QUEUE_IOV;
+		    of = of->next, off = 0) {
+			iov[iovcnt].iov_base = (void *)(of->data + off);
+			iov[iovcnt++].iov_len = of->len - off;
+		}
+		nwritten = writev(websock->socket, iov, iovcnt);
+		if (nwritten == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!wait)
+					return 1;
+				if (websocket_wait(websock, POLLOUT) == 0)
+					continue;
+			}
+			return -1;
+		}
+		queue_advance(websock, nwritten);
+	}
+	queue_changed(websock);
+	return 0;
+}
+
+static void
+queue_clear(WEBSOCKET *websock)
+{
+	OUTFRAME *of;
+
+	while ((of = websock->qhead) != NULL) {
+		websock->qhead = of->next;
+		frame_unref(of->frame);
+		free(of);
+	}
+	websock->qtail = NULL;
+	websock->qlen = websock->qoff = websock->qinflight = 0;
+}
+
+/*
+ * Add a message, given as a vector of buffers that is copied or as a frame
+ * that is referenced, to the output queue.  Returns 1 if it was added, 0
+ * if it was dropped and -1 on errors.
+ */
+static int
+queue_append(WEBSOCKET *websock, struct iovec *iov, int iovcnt,
+    FRAME *frame, lua_Integer key)
+{
+	OUTFRAME *prev;
+
+	/* A message that supersedes a queued one is never dropped */
+	if (websock->qdrop && websock->qlen > websock->qhigh &&
+	    (key == 0 || queue_find(websock, key, &prev) == NULL)) {
+		websock->qdropped++;
+		return 0;
+	}
+	websocket_active(websock);
+	if ((frame != NULL ? queue_push(websock, frame, iov->iov_base,
+	    iov->iov_len, key) : queue_copy(websock, iov, iovcnt, key)) < 0)
+		return -1;
+	return 1;
+}
+
+/*
+ * Queue a message and write out what the socket takes.  Returns 1 if the
+ * queue stays below the high watermark, 0 if it is above it or the
+ * message was dropped and -1 on errors.
+ */
+static int
+queue_message(WEBSOCKET *websock, struct iovec *iov, int iovcnt,
+    FRAME *frame, lua_Integer key)
+{
+	int ret;
+
+	if ((ret = queue_append(websock, iov, iovcnt, frame, key)) != 1)
+		return ret;
+	if (!websock->corked && !websock->suspended &&
+	    queue_flush(websock, 0) == -1)
+		return -1;
+	return websock->qlen <= websock->qhigh;
+}
+
+static int
+websocket_read(void *data, unsigned char *dest, size_t len)
+{
+	WEBSOCKET *websock = (WEBSOCKET *)data;
+	int ret;
+
+#ifdef __linux__
+	/* The io_uring poller has put all input into the reader */
+	if (websock->uconn != NULL && websock->uconn->ringfed) {
+		websock->uconn->unread = 0;
+		if (websock->uconn->rxerror == -1)
+			return 0;
+		errno = websock->uconn->rxerror ? websock->uconn->rxerror :
+		    EAGAIN;
+		return -1;
+	}
+#endif
+	if (websock->ssl) {
+		if ((ret = SSL_read(websock->ssl, dest, len)) <= 0) {
+			switch (SSL_get_error(websock->ssl, ret)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+	} else {
+		while ((ret = recv(websock->socket, dest, len, 0)) == -1 &&
+		    errno == EINTR)
+			;
+	}
+
+	/* Input, like the answer to a keepalive ping, shows the peer is up */
+	if (ret > 0 && websock->poller != NULL)
+		websock->lastrx = websock->poller->wheel.now;
+	return ret;
+}
+
+static int
+websocket_write(void *data, unsigned char *dest, size_t len)
+{
+	WEBSOCKET *websock = (WEBSOCKET *)data;
+	struct iovec iov;
+
+	iov.iov_base = dest;
+	iov.iov_len = len;
+
+	/*
+	 * Control frames must not end up in the middle of a message that is
+	 * written in part, they are queued and go out after it.
+	 */
+	if (websock->queueing || websock->suspended || websock->qhead != NULL) {
+		if (queue_copy(websock, &iov, 1, 0) < 0)
+			return -1;
+		if (websock->suspended)
+			return len;
+		return queue_flush(websock, !websock->queueing) == -1 ? -1 :
+		    (int)len;
+	}
+	return websocket_writev(websock, &iov, 1, 1) ? -1 : (int)len;
+}
+
+/*
+ * Input that is already buffered will not be signalled by epoll, let the
+ * poller report the connection as readable.
+ */
+static void
+websocket_buffered(WEBSOCKET *websock)
+{
+#ifdef __linux__
+	if (websock->poller != NULL && !websock->pending &&
+	    (websock->reader.start < websock->reader.end ||
+	    (websock->ssl && SSL_pending(websock->ssl)))) {
+		LIST_INSERT_HEAD(&websock->poller->pending, websock, pendings);
+		websock->pending = 1;
+	}
+#endif
+}
+
+static int websocket_handshake(lua_State *);
+
+static int
+websocket_handshakek(lua_State *L, int status, lua_KContext ctx)
+{
+	lua_settop(L, ctx);
+	return websocket_handshake(L);
+}
+
+/*
+ * Read and answer the opening handshake of a request for resource.  Returns
+ * 1 if the connection was upgraded, 0 if the request is not complete yet
+ * and -1 if it was refused or could not be answered.
+ */
+static int
+websocket_upgrade(WEBSOCKET *websock, const char *resource)
+{
+	unsigned char buf[WS_MAX_ANSWER];
+	size_t len;
+
+	switch (wsReadHandshake(&websock->reader, &websock->handshake,
+	    websocket_read, websock)) {
+	case WS_INCOMPLETE_FRAME:
+		return 0;
+	case WS_OPENING_FRAME:
+		if (websock->handshake.resource.len == strlen(resource) &&
+		    !memcmp(websock->handshake.resource.s, resource,
+		    websock->handshake.resource.len)) {
+			if (wsNegotiateDeflate(&websock->handshake,
+			    &websock->deflate)) {
+				websock->deflate = websock->handshake.deflate;
+				wsEnableDeflate(&websock->reader,
+				    &websock->deflater, &websock->deflate);
+			} else
+				websock->deflate.enabled = 0;
+			len = sizeof(buf);
+			wsGetHandshakeAnswer(&websock->handshake, buf, &len);
+			freeHandshake(&websock->handshake);
+			if (websocket_write(websock, buf, len) < 0)
+				return -1;
+			websock->established = 1;
+			return 1;
+		}
+		freeHandshake(&websock->handshake);
+		len = sprintf((char *)buf, "HTTP/1.1 404 Not Found\r\n\r\n");
+		websocket_write(websock, buf, len);
+		return -1;
+	default:
+		freeHandshake(&websock->handshake);
+		len = sprintf((char *)buf,
+			"HTTP/1.1 400 Bad Request\r\n"
+			"%s%s\r\n\r\n",
+			versionField,
+			version);
+		websocket_write(websock, buf, len);
+		return -1;
+	}
+}
+
+/*
+ * Read and answer the opening handshake, ws:handshake(resource).  The
+ * request is read into the read-ahead buffer, so it can arrive in pieces on
+ * a non-blocking socket and frames sent right after it are returned by the
+ * next call to recv.
+ */
+static int
+websocket_handshake(lua_State *L)
+{
+	WEBSOCKET *websock;
+	const char *resource;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	resource = luaL_checkstring(L, 2);
+
+	/* The pool that accepted the connection did it already */
+	if (websock->upgraded) {
+		websock->upgraded = 0;
+		websocket_buffered(websock);
+#ifdef __linux__
+		if (websock->poller != NULL)
+			keepalive_start(websock->poller, websock);
+#endif
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	switch (websocket_upgrade(websock, resource)) {
+	case 0:
+		if (websocket_canyield(L, websock))
+			return websocket_yield(L, 1, "r", lua_gettop(L),
+			    websocket_handshakek);
+		lua_pushboolean(L, 0);
+		break;
+	case 1:
+		websocket_buffered(websock);
+#ifdef __linux__
+		if (websock->poller != NULL)
+			keepalive_start(websock->poller, websock);
+#endif
+		lua_pushboolean(L, 1);
+		break;
+	default:
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+#ifdef __linux__
+static void
+tlspool_discard(WEBSOCKET *websock)
+{
+	if (websock->ssl != NULL) {
+		SSL_set_shutdown(websock->ssl,
+		    SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		SSL_free(websock->ssl);
+	}
+	close(websock->socket);
+	freeReader(&websock->reader);
+	freeHandshake(&websock->handshake);
+	freeDeflater(&websock->deflater);
+}
+
+/*
+ * Accept connections and complete their handshakes.  The socket blocks,
+ * with timeouts, so a client that stalls ties up a thread for at most
+ * timeout seconds per read or write.
+ */
+static void *
+tlspool_thread(void *arg)
+{
+	TLSPOOL *pool = arg;
+	POOLEDCONN *conn;
+	WEBSOCKET *acc;
+	struct timeval tv;
+	uint64_t one = 1;
+	int socket;
+
+	for (;;) {
+		socket = accept(pool->listenfd, NULL, NULL);
+		if (pool->stop) {
+			if (socket != -1)
+				close(socket);
+			break;
+		}
+		if (socket == -1) {
+			/* Don't spin while out of descriptors */
+			if (errno == EMFILE || errno == ENFILE)
+				usleep(100000);
+			continue;
+		}
+		if ((conn = calloc(1, sizeof(POOLEDCONN))) == NULL) {
+			close(socket);
+			continue;
+		}
+		acc = &conn->websock;
+		acc->socket = socket;
+		nullReader(&acc->reader);
+		nullHandshake(&acc->handshake);
+		nullDeflater(&acc->deflater);
+		acc->reader.maxMessageSize = pool->maxMessageSize;
+		acc->deflate = pool->deflate;
+
+		tv.tv_sec = pool->timeout;
+		tv.tv_usec = 0;
+		setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if ((acc->ssl = SSL_new(pool->ctx)) == NULL ||
+		    !SSL_set_fd(acc->ssl, socket))
+			goto fail;
+		SSL_set_mode(acc->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		if (SSL_accept(acc->ssl) != 1)
+			goto fail;
+		if (pool->resource != NULL) {
+			if (websocket_upgrade(acc, pool->resource) != 1)
+				goto fail;
+			acc->upgraded = 1;
+		}
+
+		tv.tv_sec = 0;
+		setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (pool->nonblocking) {
+			if (websocket_setnonblocking(socket, 1))
+				goto fail;
+			acc->nonblocking = 1;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		STAILQ_INSERT_TAIL(&pool->done, conn, entries);
+		pthread_mutex_unlock(&pool->lock);
+		write(pool->efd, &one, sizeof(one));
+		continue;
+fail:
+		tlspool_discard(acc);
+		free(conn);
+	}
+	return NULL;
+}
+
+/* Stop the threads, the listening socket is closed */
+static void
+tlspool_stop(WEBSOCKET *websock)
+{
+	TLSPOOL *pool = websock->pool;
+	POOLEDCONN *conn;
+	int n;
+
+	pool->stop = 1;
+	shutdown(pool->listenfd, SHUT_RDWR);
+	for (n = 0; n < pool->nthreads; n++)
+		pthread_join(pool->threads[n], NULL);
+	close(pool->listenfd);
+	while ((conn = STAILQ_FIRST(&pool->done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&pool->done, entries);
+		tlspool_discard(&conn->websock);
+		free(conn);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->resource);
+	free(pool);
+	websock->pool = NULL;
+}
+
+/*
+ * Hand the connections of a secure listener to nthreads threads that
+ * accept them and complete the TLS handshake, so that the handshakes do
+ * not hold up the Lua state: ws:tlspool(nthreads[, opts]).  If opts.upgrade
+ * names a resource, the threads also answer the opening handshake and
+ * ws:handshake() returns true for the connections right away.  A thread
+ * gives up on a client after opts.timeout seconds (10) without progress.
+ *
+ * accept() returns connections that are ready.  The socket of the listener,
+ * which a poller waits on, is replaced by an eventfd signalling them.
+ * Settings of the listener, like deflate() and maxsize(), have to be made
+ * before.
+ */
+static int
+websocket_tlspool(lua_State *L)
+{
+	WEBSOCKET *websock;
+	TLSPOOL *pool;
+	const char *resource;
+	int nthreads, opts, error;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	nthreads = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, nthreads > 0, 2, "must be positive");
+	opts = lua_istable(L, 3) ? 3 : 0;
+	if (websock->ctx == NULL)
+		return luaL_error(L, "not a secure listener");
+	if (websock->pool != NULL)
+		return luaL_error(L, "listener has a pool already");
+	if (websock->poller != NULL)
+		return luaL_error(L, "listener is registered with a poller");
+
+	if ((pool = calloc(1, sizeof(TLSPOOL))) == NULL)
+		return luaL_error(L, "memory error");
+	pool->ctx = websock->ctx;
+	pool->nonblocking = websock->nonblocking;
+	pool->maxMessageSize = websock->reader.maxMessageSize;
+	pool->deflate = websock->deflate;
+	pool->timeout = websocket_optint(L, opts, "timeout", 10);
+	pthread_mutex_init(&pool->lock, NULL);
+	STAILQ_INIT(&pool->done);
+	if (opts != 0) {
+		lua_getfield(L, opts, "upgrade");
+		resource = lua_tostring(L, -1);
+		if (resource != NULL)
+			pool->resource = strdup(resource);
+		lua_pop(L, 1);
+	}
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->threads == NULL || pool->efd == -1 ||
+	    websocket_setnonblocking(websock->socket, 0)) {
+		error = errno;
+		goto fail;
+	}
+
+	/* The threads block in accept() */
+	pool->listenfd = websock->socket;
+	websock->socket = pool->efd;
+	websock->pool = pool;
+	for (; pool->nthreads < nthreads; pool->nthreads++)
+		if ((error = pthread_create(&pool->threads[pool->nthreads],
+		    NULL, tlspool_thread, pool))) {
+			websock->socket = pool->listenfd;
+			pool->stop = 1;
+			shutdown(pool->listenfd, SHUT_RD);
+			while (pool->nthreads > 0)
+				pthread_join(pool->threads[--pool->nthreads],
+				    NULL);
+			websock->pool = NULL;
+			goto fail;
+		}
+	return 0;
+
+fail:
+	websocket_setnonblocking(websock->socket, websock->nonblocking);
+	if (pool->efd != -1)
+		close(pool->efd);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->resource);
+	free(pool);
+	return luaL_error(L, "can't start TLS pool: %s", strerror(error));
+}
+
+/* Return a connection the pool has completed */
+static int
+websocket_poolaccept(lua_State *L, WEBSOCKET *websock)
+{
+	TLSPOOL *pool = websock->pool;
+	POOLEDCONN *conn;
+	WEBSOCKET *acc;
+	uint64_t count;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if ((conn = STAILQ_FIRST(&pool->done)) != NULL)
+			STAILQ_REMOVE_HEAD(&pool->done, entries);
+		else
+			read(pool->efd, &count, sizeof(count));
+		pthread_mutex_unlock(&pool->lock);
+		if (conn != NULL)
+			break;
+		if (websock->nonblocking) {
+			if (websocket_canyield(L, websock))
+				return websocket_yield(L, 1, "r",
+				    lua_gettop(L), websocket_acceptk);
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if (websocket_wait(websock, POLLIN))
+			return luaL_error(L, "error accepting connection");
+	}
+
+	lua_settop(L, 1);
+	acc = lua_newuserdata(L, sizeof(WEBSOCKET));
+	*acc = conn->websock;
+	free(conn);
+	luaL_getmetatable(L, WEBSOCKET_METATABLE);
+	lua_setmetatable(L, -2);
+	acc->queueing = websock->queueing;
+	acc->qhigh = websock->qhigh;
+	acc->qlow = websock->qlow;
+	acc->qdrop = websock->qdrop;
+	websocket_tlsdone(acc);
+	return 1;
+}
+#endif
+
+static const char *const frame_types[] = { "text", "binary", NULL };
+static const enum wsFrameType frame_opcodes[] = {
+	WS_TEXT_FRAME, WS_BINARY_FRAME
+};
+
+#ifdef __linux__
+/* Report events of a connection registered with an io_uring poller */
+static void
+uconn_ready(POLLER *poller, URINGCONN *u, uint32_t events)
+{
+	if (u->websock == NULL)
+		return;
+	u->revents |= events;
+	if (!u->ready) {
+		LIST_INSERT_HEAD(&poller->ready, u, readies);
+		u->ready = 1;
+	}
+}
+
+/* Submit the requests of a connection before the next wait */
+static void
+uconn_dirty(POLLER *poller, URINGCONN *u)
+{
+	if (u->websock != NULL && !u->dirty) {
+		LIST_INSERT_HEAD(&poller->dirty, u, dirties);
+		u->dirty = 1;
+	}
+}
+
+/* Queue a socket accepted by a multishot accept */
+static int
+uconn_pushfd(URINGCONN *u, int fd)
+{
+	int *fds;
+	size_t size;
+
+	if (u->nfds == u->fdsize) {
+		size = u->fdsize ? u->fdsize * 2 : 16;
+		if ((fds = realloc(u->fds, size * sizeof(int))) == NULL)
+			return -1;
+		u->fds = fds;
+		u->fdsize = size;
+	}
+	u->fds[u->nfds++] = fd;
+	return 0;
+}
+
+static struct io_uring_sqe *
+uconn_sqe(POLLER *poller, URINGCONN *u, int tag, int opcode)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(poller->ring)) == NULL)
+		return NULL;
+	sqe->opcode = opcode;
+	sqe->fd = u->websock->socket;
+	sqe->user_data = (uintptr_t)u | tag;
+	u->inflight++;
+	return sqe;
+}
+
+/*
+ * Submit the requests connections are missing: a multishot receive or
+ * accept, which is ended by the kernel when it runs out of buffers or on
+ * errors, and one-shot polls for the events waited on.  Polls that are no
+ * longer wanted are left to complete, their events are filtered.
+ */
+static void
+poller_arm(POLLER *poller)
+{
+	struct io_uring_sqe *sqe;
+	URINGCONN *u;
+	uint32_t want;
+
+	while ((u = LIST_FIRST(&poller->dirty)) != NULL) {
+		want = u->websock->interest;
+		if (u->ringfed && !u->recving && u->rxerror == 0) {
+			if ((sqe = uconn_sqe(poller, u, URING_RECV,
+			    IORING_OP_RECV)) == NULL)
+				return;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			u->recving = 1;
+		}
+		if (u->listener && !u->accepting) {
+			if ((sqe = uconn_sqe(poller, u, URING_ACCEPT,
+			    IORING_OP_ACCEPT)) == NULL)
+				return;
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			u->accepting = 1;
+		}
+		if ((want & EPOLLIN) && !u->ringfed && !u->listener &&
+		    !u->pollin) {
+			if ((sqe = uconn_sqe(poller, u, URING_POLLIN,
+			    IORING_OP_POLL_ADD)) == NULL)
+				return;
+			sqe->poll32_events = POLLIN;
+			u->pollin = 1;
+		}
+		if ((want & EPOLLOUT) && !u->pollout) {
+			if ((sqe = uconn_sqe(poller, u, URING_POLLOUT,
+			    IORING_OP_POLL_ADD)) == NULL)
+				return;
+			sqe->poll32_events = POLLOUT;
+			u->pollout = 1;
+		}
+		LIST_REMOVE(u, dirties);
+		u->dirty = 0;
+	}
+}
+
+/* Process completions */
+static void
+poller_reap(POLLER *poller)
+{
+	struct io_uring_cqe *cqe;
+	URINGCONN *u;
+	WEBSOCKET *websock;
+	unsigned int bid;
+	int res, more;
+
+	while ((cqe = uring_cqe(poller->ring)) != NULL) {
+		if (cqe->user_data == 0) {	/* cancellations */
+			uring_cqeseen(poller->ring);
+			continue;
+		}
+		u = (URINGCONN *)(uintptr_t)(cqe->user_data &
+		    ~(uint64_t)URING_TAGMASK);
+		websock = u->websock;
+		res = cqe->res;
+		more = cqe->flags & IORING_CQE_F_MORE;
+
+		switch (cqe->user_data & URING_TAGMASK) {
+		case URING_POLLIN:
+			u->pollin = 0;
+			if (res > 0)
+				uconn_ready(poller, u, res);
+			break;
+		case URING_POLLOUT:
+			u->pollout = 0;
+			if (res > 0)
+				uconn_ready(poller, u, res);
+			break;
+		case URING_RECV:
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				if (websock != NULL && res > 0 &&
+				    wsFeed(&websock->reader,
+				    uring_buf(poller->ring, bid), res))
+					res = -ENOMEM;
+				uring_bufreturn(poller->ring, bid);
+			}
+			if (!more)
+				u->recving = 0;
+			if (res > 0) {
+				u->unread = 1;
+				uconn_ready(poller, u, EPOLLIN);
+			} else if (res == 0) {
+				u->rxerror = -1;
+				uconn_ready(poller, u, EPOLLIN | EPOLLHUP);
+			} else if (res == -EINVAL) {
+				/* Before Linux 6.0, receive when readable */
+				poller->norecv = 1;
+				u->ringfed = 0;
+				uconn_ready(poller, u, EPOLLIN);
+			} else if (res != -ENOBUFS && res != -ECANCELED) {
+				u->rxerror = -res;
+				uconn_ready(poller, u, EPOLLIN | EPOLLERR);
+			}
+			break;
+		case URING_ACCEPT:
+			if (!more)
+				u->accepting = 0;
+			if (res >= 0) {
+				if (websock == NULL || uconn_pushfd(u, res))
+					close(res);
+				else
+					uconn_ready(poller, u, EPOLLIN);
+			} else if (res == -EINVAL) {
+				poller->noaccept = 1;
+				u->listener = 0;
+				uconn_ready(poller, u, EPOLLIN);
+			}
+			break;
+		}
+		uring_cqeseen(poller->ring);
+
+		if (more)
+			continue;
+		if (--u->inflight == 0 && u->websock == NULL) {
+			LIST_REMOVE(u, entries);
+			free(u);
+		} else
+			uconn_dirty(poller, u);
+	}
+}
+
+/*
+ * Wait for events like epoll_wait().  All submissions are made with the
+ * same system call that waits for completions.
+ */
+static int
+poller_poll(POLLER *poller, struct epoll_event *events, int maxevents,
+    int timeout)
+{
+	URINGCONN *u;
+	uint32_t ev;
+	int n;
+
+	if (poller->ring == NULL)
+		return epoll_wait(poller->epfd, events, maxevents, timeout);
+
+	poller_arm(poller);
+	if (uring_enter(poller->ring, LIST_EMPTY(&poller->ready) &&
+	    timeout != 0 ? 1 : 0, timeout))
+		return -1;
+	poller_reap(poller);
+
+	for (n = 0; n < maxevents &&
+	    (u = LIST_FIRST(&poller->ready)) != NULL; ) {
+		LIST_REMOVE(u, readies);
+		u->ready = 0;
+		ev = u->revents & (u->websock->interest | EPOLLERR | EPOLLHUP);
+		u->revents = 0;
+		if (ev == 0)
+			continue;
+		events[n].events = ev;
+		events[n++].data.ptr = u->websock;
+	}
+	return n;
+}
+
+/* Register a connection with an io_uring poller */
+static int
+poller_uadd(POLLER *poller, WEBSOCKET *websock)
+{
+	URINGCONN *u;
+	socklen_t len;
+	int listening;
+
+	if ((u = calloc(1, sizeof(URINGCONN))) == NULL)
+		return -1;
+	u->websock = websock;
+
+	/*
+	 * Blocking sockets are expected to block in accept() and recv().
+	 * Other descriptors, like the eventfd of a TLS pool, are polled.
+	 */
+	len = sizeof(listening);
+	if (getsockopt(websock->socket, SOL_SOCKET, SO_ACCEPTCONN,
+	    &listening, &len) == 0) {
+		if (listening)
+			u->listener = websock->nonblocking &&
+			    !poller->noaccept;
+		else
+			u->ringfed = websock->nonblocking &&
+			    websock->ssl == NULL && !poller->norecv;
+	}
+	LIST_INSERT_HEAD(&poller->uconns, u, entries);
+	websock->uconn = u;
+	uconn_dirty(poller, u);
+	return 0;
+}
+
+/*
+ * Changed interest of a connection.  Input and connections that were
+ * already received are reported when they are waited for.
+ */
+static void
+poller_umod(POLLER *poller, URINGCONN *u)
+{
+	if ((u->websock->interest & EPOLLIN) &&
+	    ((u->ringfed && (u->unread || u->rxerror)) ||
+	    (u->listener && u->nfds > 0)))
+		uconn_ready(poller, u, EPOLLIN);
+	uconn_dirty(poller, u);
+}
+
+/*
+ * Unregister a connection from an io_uring poller.  Its requests are
+ * cancelled, input received until then is kept in the reader.
+ */
+static void
+poller_uremove(POLLER *poller, WEBSOCKET *websock)
+{
+	URINGCONN *u = websock->uconn;
+	struct io_uring_sqe *sqe;
+
+	if (u->inflight > 0 && websock->socket != -1 &&
+	    (sqe = uring_sqe(poller->ring)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = websock->socket;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+		    IORING_ASYNC_CANCEL_ALL;
+		uring_enter(poller->ring, 0, 0);
+		poller_reap(poller);
+		while (u->recving || u->accepting) {
+			if (uring_enter(poller->ring, 1, -1) &&
+			    errno != EINTR)
+				break;
+			poller_reap(poller);
+		}
+	}
+	while (u->nfds > 0)
+		close(u->fds[--u->nfds]);
+	free(u->fds);
+	u->fds = NULL;
+	if (u->ready)
+		LIST_REMOVE(u, readies);
+	if (u->dirty)
+		LIST_REMOVE(u, dirties);
+	u->websock = NULL;
+	websock->uconn = NULL;
+	if (u->inflight == 0) {
+		LIST_REMOVE(u, entries);
+		free(u);
+	}
+}
+
+/*
+ * A coroutine that waits on a connection in a direction another one
+ * already waits in is parked, the coroutine on top of the stack is popped.
+ */
+static void
+poller_park(lua_State *L, POLLER *poller, int *parked)
+{
+	if (*parked == 0) {
+		lua_newtable(L);
+		*parked = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, *parked);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+	lua_pop(L, 1);
+	poller->nwaiting++;
+}
+
+/* Parked coroutines try again once the one waiting before them is woken */
+static void
+poller_unpark(lua_State *L, POLLER *poller, int *parked)
+{
+	lua_Integer n, nparked;
+
+	if (*parked == 0)
+		return;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, poller->runq);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, *parked);
+	nparked = lua_rawlen(L, -1);
+	for (n = 1; n <= nparked; n++) {
+		lua_rawgeti(L, -1, n);
+		lua_rawseti(L, -3, lua_rawlen(L, -3) + 1);
+	}
+	lua_pop(L, 2);
+	luaL_unref(L, LUA_REGISTRYINDEX, *parked);
+	*parked = 0;
+	poller->nwaiting -= nparked;
+}
+
+/* Move the coroutines waiting on a connection to the run queue */
+static void
+poller_ready(lua_State *L, POLLER *poller, int *thread, int *parked)
+{
+	poller_unpark(L, poller, parked);
+	if (*thread == 0)
+		return;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, poller->runq);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, *thread);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+	lua_pop(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, *thread);
+	*thread = 0;
+	poller->nwaiting--;
+}
+
+/*
+ * Remove a connection from its poller.  Coroutines waiting on it are
+ * resumed by the scheduler, the operation they are suspended in fails.
+ */
+static void
+poller_remove(lua_State *L, WEBSOCKET *websock)
+{
+	POLLER *poller = websock->poller;
+
+	if (poller == NULL)
+		return;
+	if (websock->uconn != NULL)
+		poller_uremove(poller, websock);
+	else if (websock->socket != -1)
+		epoll_ctl(poller->epfd, EPOLL_CTL_DEL, websock->socket, NULL);
+	LIST_REMOVE(websock, entries);
+	wheel_del(&poller->wheel, &websock->katimer);
+	if (websock->pending) {
+		LIST_REMOVE(websock, pendings);
+		websock->pending = 0;
+	}
+	poller_ready(L, poller, &websock->rthread, &websock->rparked);
+	poller_ready(L, poller, &websock->wthread, &websock->wparked);
+	websock->poller = NULL;
+	websock->events = websock->interest = 0;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CONNECTIONS_TABLE);
+	lua_pushnil(L);
+	lua_rawsetp(L, -2, websock);
+	lua_pop(L, 1);
+}
+#endif
+
+/*
+ * Remove a subscription to a topic of a hub.  The topic is removed with
+ * its last subscriber.
+ */
+static void
+subscription_remove(lua_State *L, SUBSCRIPTION *sub)
+{
+	TOPIC *topic = sub->topic;
+
+	LIST_REMOVE(sub, topicsubs);
+	LIST_REMOVE(sub, connsubs);
+	if (sub->dirty)
+		LIST_REMOVE(sub, dirties);
+	free(sub);
+	if (--topic->nsubs > 0)
+		return;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, topic->hub->names);
+	lua_pushlstring(L, topic->name, topic->namelen);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	LIST_REMOVE(topic, entries);
+	free(topic);
+}
+
+/*
+ * Release all resources of a connection.  If graceful is set, a TLS close
+ * notify alert is sent before the connection is closed.
+ */
+static void
+websocket_release(lua_State *L, WEBSOCKET *websock, int graceful)
+{
+#ifdef __linux__
+	poller_remove(L, websock);
+#endif
+	while (!LIST_EMPTY(&websock->subs))
+		subscription_remove(L, LIST_FIRST(&websock->subs));
+	/* A graceful close writes what the socket takes of the queue */
+	if (graceful && websock->qhead != NULL && !websock->suspended)
+		queue_flush(websock, 0);
+#ifdef __linux__
+	if (websock->pool != NULL)
+		tlspool_stop(websock);
+#endif
+	if (websock->ssl != NULL) {
+		if (graceful)
+			SSL_shutdown(websock->ssl);
+		else
+			SSL_set_shutdown(websock->ssl,
+			    SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		SSL_free(websock->ssl);
+		websock->ssl = NULL;
+	}
+	if (websock->socket != -1) {
+		close(websock->socket);
+		websock->socket = -1;
+	}
+	if (websock->ctx != NULL) {
+		SSL_CTX_free(websock->ctx);
+		websock->ctx = NULL;
+	}
+	freeReader(&websock->reader);
+	freeHandshake(&websock->handshake);
+	freeDeflater(&websock->deflater);
+	free(websock->obuf);
+	websock->obuf = NULL;
+	websock->obufsize = websock->obuflen = 0;
+	websock->corked = 0;
+	queue_clear(websock);
+	websock->suspended = 0;
+}
+
+static int websocket_recv(lua_State *);
+
+static int
+websocket_recvk(lua_State *L, int status, lua_KContext ctx)
+{
+	lua_settop(L, ctx);
+	return websocket_recv(L);
+}
+
+static int
+websocket_recv(lua_State *L)
+{
+	WEBSOCKET *websock;
+	char *buf;
+	size_t len;
+	enum wsFrameType type;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	if (websock->socket == -1) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	switch (type = wsRead(&websock->reader, &buf, &len, websocket_read,
+	    websocket_write, websock)) {
+	case WS_TEXT_FRAME:
+	case WS_BINARY_FRAME:
+		lua_pushlstring(L, buf, len);
+		lua_pushstring(L, frame_types[type == WS_TEXT_FRAME ? 0 : 1]);
+		websocket_buffered(websock);
+		websocket_active(websock);
+		return 2;
+	case WS_INCOMPLETE_FRAME:
+		/* Non-blocking socket without a complete message */
+		if (websocket_canyield(L, websock))
+			return websocket_yield(L, 1, "r", lua_gettop(L),
+			    websocket_recvk);
+		lua_pushboolean(L, 0);
+		return 1;
+	default:
+		websocket_release(L, websock, 1);
+		lua_pushnil(L);
+		return 1;
+	}
+}
+
+/*
+ * Write a message, or queue it behind output that waits for the socket or
+ * a file that is being sent.  Returns like websocket_writev(), 1 means the
+ * message, or what is left of it, is in the output queue.
+ */
+static int
+websocket_put(WEBSOCKET *websock, struct iovec *iov, int iovcnt, int wait)
+{
+	if (websock->qhead == NULL && !websock->suspended)
+		return websocket_writev(websock, iov, iovcnt, wait);
+	if (queue_copy(websock, iov, iovcnt, 0) == -1)
+		return -1;
+
+	/* It can not go out before the file is done */
+	if (websock->suspended)
+		return !wait;
+	return queue_flush(websock, wait);
+}
+
+static int
+websocket_flush(WEBSOCKET *websock, int wait)
+{
+	struct iovec iov;
+
+	if (websock->obuflen == 0)
+		return 0;
+	iov.iov_base = websock->obuf;
+	iov.iov_len = websock->obuflen;
+	websock->obuflen = 0;
+	return websocket_put(websock, &iov, 1, wait);
+}
+
+/*
+ * Output framed data.  While the connection is corked it is appended to the
+ * output buffer, which is flushed when it exceeds CORK_MAX bytes.
+ */
+static int
+websocket_output(WEBSOCKET *websock, struct iovec *iov, int iovcnt, int wait)
+{
+	unsigned char *obuf;
+	size_t len, size;
+	int n;
+
+	websocket_active(websock);
+	if (!websock->corked)
+		return websocket_put(websock, iov, iovcnt, wait);
+
+	for (len = 0, n = 0; n < iovcnt; n++)
+		len += iov[n].iov_len;
+	if (websock->obufsize - websock->obuflen < len) {
+		size = websock->obufsize ? websock->obufsize : TLS_RECORD_SIZE;
+		while (size - websock->obuflen < len)
+			size *= 2;
+		if ((obuf = realloc(websock->obuf, size)) == NULL)
+			return -1;
+		websock->obuf = obuf;
+		websock->obufsize = size;
+	}
+	for (n = 0; n < iovcnt; n++) {
+		memcpy(websock->obuf + websock->obuflen, iov[n].iov_base,
+		    iov[n].iov_len);
+		websock->obuflen += iov[n].iov_len;
+	}
+	if (websock->obuflen >= CORK_MAX)
+		return websocket_flush(websock, wait);
+	return 0;
+}
+
+static int websocket_sent(lua_State *, WEBSOCKET *, int);
+
+/*
+ * Continue a send that left its message in the output queue.  The end of
+ * the message in the queue is at index 2, it is done once the queue has
+ * been written up to there; other coroutines may queue more behind it.
+ */
+static int
+websocket_sentk(lua_State *L, int status, lua_KContext ctx)
+{
+	WEBSOCKET *websock;
+	uint64_t end;
+	int ret;
+
+	lua_settop(L, ctx);
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	end = lua_tointeger(L, 2);
+	if (websock->socket == -1) {
+		errno = EPIPE;
+		ret = -1;
+	} else if (websock->qhead == NULL || websock->qwritten >= end)
+		ret = 0;
+	else if (websock->suspended)
+		ret = 1;
+	else if ((ret = queue_flush(websock, 0)) == 1 &&
+	    websock->qwritten >= end)
+		ret = 0;
+	if (ret == 1)
+		return websocket_yield(L, 1, "w", 2, websocket_sentk);
+	return websocket_sent(L, websock, ret);
+}
+
+/*
+ * Complete a send with the result of websocket_output(), it returns true
+ * or nil and an error message.  If the message went to the output queue,
+ * the coroutine waits until it is written.
+ */
+static int
+websocket_sent(lua_State *L, WEBSOCKET *websock, int ret)
+{
+	switch (ret) {
+	case 0:
+		lua_pushboolean(L, 1);
+		return 1;
+	case 1:
+		lua_settop(L, 1);
+		lua_pushinteger(L, websock->qwritten + websock->qlen);
+		return websocket_yield(L, 1, "w", 2, websocket_sentk);
+	default:
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+}
+
+/*
+ * Build a compressed frame in the deflater's buffer.  A send that can not
+ * be written at once leaves a copy in the output queue, so every call
+ * starts a new frame.
+ */
+static int
+websocket_compress(WEBSOCKET *websock, const char *data, size_t datasize,
+    enum wsFrameType type)
+{
+	websock->deflater.buflen = 0;
+	return wsDeflateFrame(&websock->deflater, (const uint8_t *)data,
+	    datasize, type);
+}
+
+/*
+ * Send a message, ws:send(data[, type[, key]]), returns true or nil and an
+ * error message.  On connections with an output queue it returns whether
+ * the queue is below its high watermark and a message with a key
+ * supersedes a queued one with the same key.  Such messages are not
+ * compressed with the connection's context.
+ */
 static int
 websocket_send(lua_State *L)
 {
-	char *buf;
-	const char *data;
-	size_t datasize, framesize;
+	unsigned char hdr[WS_MAX_HEADER];
+	struct iovec iov[2];
+	const char *data;
+	size_t datasize;
+	WEBSOCKET *websock;
+	enum wsFrameType type;
+	lua_Integer key;
+	int iovcnt;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	data = luaL_checklstring(L, 2, &datasize);
+	type = frame_opcodes[luaL_checkoption(L, 3, "text", frame_types)];
+	key = luaL_optinteger(L, 4, 0);
+
+	if (websock->deflater.windowBits &&
+	    datasize >= websock->deflater.threshold &&
+	    (key == 0 || !websock->queueing)) {
+		if (websocket_compress(websock, data, datasize, type))
+			return luaL_error(L, "compression error");
+		iov[0].iov_base = websock->deflater.buf;
+		iov[0].iov_len = websock->deflater.buflen;
+		iovcnt = 1;
+	} else {
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = wsMakeFrameHeader(datasize, hdr, type);
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = datasize;
+		iovcnt = datasize > 0 ? 2 : 1;
+	}
+	if (websock->queueing) {
+		lua_pushboolean(L, queue_message(websock, iov, iovcnt, NULL,
+		    key) == 1);
+		return 1;
+	}
+	return websocket_sent(L, websock, websocket_output(websock, iov,
+	    iovcnt, !websocket_canyield(L, websock)));
+}
+
+/*
+ * Send an array of messages of the same type with a single write, returns
+ * like ws:send().
+ */
+static int
+websocket_sendv(lua_State *L)
+{
+	unsigned char stackhdr[SENDV_STACK][WS_MAX_HEADER];
+	unsigned char (*hdr)[WS_MAX_HEADER];
+	struct iovec stackiov[SENDV_STACK * 2], *iov;
+	const char *data;
+	size_t datasize;
+	WEBSOCKET *websock;
+	enum wsFrameType type;
+	lua_Integer n, nmsgs;
+	int iovcnt, ret;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	type = frame_opcodes[luaL_checkoption(L, 3, "text", frame_types)];
+
+	nmsgs = luaL_len(L, 2);
+	if (websock->deflater.windowBits && nmsgs > 0) {
+		/* The whole batch is framed into the deflater's buffer */
+		websock->deflater.buflen = 0;
+		for (n = 1; n <= nmsgs; n++) {
+			lua_rawgeti(L, 2, n);
+			data = lua_tolstring(L, -1, &datasize);
+			if (data == NULL)
+				return luaL_error(L, "message %d is not a "
+				    "string", (int)n);
+			if (wsDeflateFrame(&websock->deflater,
+			    (const uint8_t *)data, datasize, type))
+				return luaL_error(L, "compression error");
+			lua_pop(L, 1);
+		}
+		stackiov[0].iov_base = websock->deflater.buf;
+		stackiov[0].iov_len = websock->deflater.buflen;
+		if (websock->queueing) {
+			lua_pushboolean(L, queue_message(websock, stackiov, 1,
+			    NULL, 0) == 1);
+			return 1;
+		}
+		return websocket_sent(L, websock, websocket_output(websock,
+		    stackiov, 1, !websocket_canyield(L, websock)));
+	}
+
+	if (nmsgs <= SENDV_STACK) {
+		hdr = stackhdr;
+		iov = stackiov;
+	} else {
+		hdr = lua_newuserdata(L, nmsgs * (sizeof(*hdr) +
+		    2 * sizeof(*iov)));
+		iov = (struct iovec *)(hdr + nmsgs);
+	}
+
+	for (iovcnt = 0, n = 1; n <= nmsgs; n++) {
+		lua_rawgeti(L, 2, n);
+		data = lua_tolstring(L, -1, &datasize);
+		if (data == NULL)
+			return luaL_error(L, "message %d is not a string",
+			    (int)n);
+		/* The string is still referenced by the table */
+		lua_pop(L, 1);
+
+		iov[iovcnt].iov_base = hdr[n - 1];
+		iov[iovcnt++].iov_len = wsMakeFrameHeader(datasize, hdr[n - 1],
+		    type);
+		if (datasize > 0) {
+			iov[iovcnt].iov_base = (void *)data;
+			iov[iovcnt++].iov_len = datasize;
+		}
+	}
+	if (websock->queueing) {
+		lua_pushboolean(L, iovcnt == 0 ||
+		    queue_message(websock, iov, iovcnt, NULL, 0) == 1);
+		return 1;
+	}
+	ret = iovcnt > 0 ? websocket_output(websock, iov, iovcnt,
+	    !websocket_canyield(L, websock)) : 0;
+	return websocket_sent(L, websock, ret);
+}
+
+/*
+ * Write to a plain socket, or one with kernel TLS, bypassing the queue.
+ * Returns the number of bytes written, -1 on errors and 0 if wait is not
+ * set and the socket would block.
+ */
+static ssize_t
+websocket_rawwrite(WEBSOCKET *websock, const void *data, size_t len,
+    int wait)
+{
+	ssize_t nwritten;
+
+	for (;;) {
+		if ((nwritten = write(websock->socket, data, len)) != -1)
+			return nwritten;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!wait)
+			return 0;
+		if (websocket_wait(websock, POLLOUT))
+			return -1;
+	}
+}
+
+/*
+ * Write a binary frame with len bytes of a file as payload.  Returns 0
+ * when it has been written, -1 on errors and 1 if wait is not set and the
+ * socket would block.  On plain sockets and with kernel TLS the payload is
+ * passed to the socket with sendfile(), otherwise it is read in records of
+ * TLS_RECORD_SIZE bytes which start at the same offsets when a suspended
+ * write is continued.  done counts the header and the payload written.
+ */
+static int
+websocket_sendfd(WEBSOCKET *websock, int fd, off_t offset, size_t len,
+    size_t *done, int wait)
+{
+	unsigned char hdr[WS_MAX_HEADER], record[TLS_RECORD_SIZE];
+	size_t hlen, total, start, end, n;
+	ssize_t nread;
+	int ret;
+
+	hlen = wsMakeFrameHeader(len, hdr, WS_BINARY_FRAME);
+	total = hlen + len;
+
+	if (websock->ssl == NULL || websock->ktlstx) {
+		while (*done < hlen) {
+			if ((nread = websocket_rawwrite(websock, hdr + *done,
+			    hlen - *done, wait)) <= 0)
+				return nread == 0 ? 1 : -1;
+			*done += nread;
+		}
+#ifdef __linux__
+		while (*done < total) {
+			off_t off = offset + (*done - hlen);
+
+			n = total - *done;
+			if (n > 0x7ffff000)
+				n = 0x7ffff000;
+			nread = sendfile(websock->socket, fd, &off, n);
+			if (nread == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					if (!wait)
+						return 1;
+					if (websocket_wait(websock, POLLOUT))
+						break;
+					continue;
+				}
+				/* Not a file sendfile() can read from */
+				if (errno == EINVAL || errno == ENOSYS)
+					goto chunked;
+				break;
+			}
+			if (nread == 0) {
+				errno = EIO;	/* the file is shorter */
+				break;
+			}
+			*done += nread;
+		}
+		return *done < total ? -1 : 0;
+#endif
+	}
+
+chunked:
+	while (*done < total) {
+		start = *done - *done % sizeof(record);
+		end = start + sizeof(record) < total ?
+		    start + sizeof(record) : total;
+		for (n = start; n < hlen && n < end; n++)
+			record[n - start] = hdr[n];
+		while (n < end) {
+			nread = pread(fd, record + (n - start), end - n,
+			    offset + (n - hlen));
+			if (nread == -1 && errno == EINTR)
+				continue;
+			if (nread <= 0) {
+				if (nread == 0)
+					errno = EIO;
+				return -1;
+			}
+			n += nread;
+		}
+		if (websock->ssl && !websock->ktlstx) {
+			if ((ret = websocket_sslwrite(websock, record,
+			    end - start, wait)))
+				return ret;
+			*done = end;
+			continue;
+		}
+
+		/* After a fallback from sendfile() in mid-record */
+		while (*done < end) {
+			if ((nread = websocket_rawwrite(websock,
+			    record + (*done - start), end - *done, wait)) <= 0)
+				return nread == 0 ? 1 : -1;
+			*done += nread;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A file opened by ws:sendfile() from its path.  It is kept open until the
+ * send is done, so the whole message comes from the same file.
+ */
+static void
+sendfile_closefd(int *fd)
+{
+	if (*fd != -1) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+static int
+sendfile_close(lua_State *L)
+{
+	sendfile_closefd(luaL_checkudata(L, 1, SENDFILE_METATABLE));
+	return 0;
+}
+
+/* Close the file at index 2 unless it was given as a descriptor */
+static void
+sendfile_done(lua_State *L)
+{
+	int *fd;
+
+	if ((fd = luaL_testudata(L, 2, SENDFILE_METATABLE)) != NULL)
+		sendfile_closefd(fd);
+}
+
+/*
+ * Continue ws:sendfile().  The file is at index 2, as a descriptor or an
+ * opened file, the offset and length are at index 3 and 4, at index 5 the
+ * number of bytes written, -1 until the file has the connection, and at
+ * index 6 the token it got the connection with.  Only the send holding the
+ * current token writes the file, any other waits until the connection is
+ * free.
+ */
+static int
+websocket_sendfilek(lua_State *L, int status, lua_KContext ctx)
+{
+	WEBSOCKET *websock;
+	size_t done;
+	int fd, ret, wait;
+
+	lua_settop(L, ctx);
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	wait = !websocket_canyield(L, websock);
+	if (websock->socket == -1) {
+		sendfile_done(L);
+		return luaL_error(L, "can't send file: connection closed");
+	}
+
+	if (lua_tointeger(L, 5) == -1) {
+		/* Corked output, queued frames and another file go first */
+		if ((ret = websocket_flush(websock, wait)) == 0 &&
+		    websock->qhead != NULL && !websock->suspended)
+			ret = queue_flush(websock, wait);
+		if (ret == -1) {
+			ret = errno;
+			sendfile_done(L);
+			return luaL_error(L, "can't send file: %s",
+			    strerror(ret));
+		}
+		if (ret == 0 && websock->suspended) {
+			if (wait) {
+				sendfile_done(L);
+				return luaL_error(L, "can't send file: "
+				    "another file is being sent");
+			}
+			ret = 1;
+		}
+		if (ret == 1)
+			return websocket_yield(L, 1, "w", 6,
+			    websocket_sendfilek);
+		websock->suspended = 1;
+		lua_pushinteger(L, ++websock->sendtoken);
+		lua_replace(L, 6);
+		done = 0;
+	} else if (!websock->suspended ||
+	    (unsigned long)lua_tointeger(L, 6) != websock->sendtoken) {
+		sendfile_done(L);
+		return luaL_error(L, "can't send file: connection reset");
+	} else
+		done = lua_tointeger(L, 5);
+
+	if (lua_type(L, 2) == LUA_TNUMBER)
+		fd = lua_tointeger(L, 2);
+	else
+		fd = *(int *)lua_touserdata(L, 2);
+	ret = websocket_sendfd(websock, fd, lua_tointeger(L, 3),
+	    lua_tointeger(L, 4), &done, wait);
+	if (ret == 1) {
+		lua_pushinteger(L, done);
+		lua_replace(L, 5);
+		return websocket_yield(L, 1, "w", 6, websocket_sendfilek);
+	}
+
+	websock->suspended = 0;
+	if (ret == -1)
+		lua_pushfstring(L, "can't send file: %s", strerror(errno));
+	sendfile_done(L);
+	if (ret == -1) {
+		/* Nothing else can be written after part of a frame */
+		if (done > 0)
+			websocket_release(L, websock, 0);
+		return lua_error(L);
+	}
+
+	/* Output that was queued behind the file */
+	if (websock->qhead != NULL)
+		queue_flush(websock, !websock->queueing && wait);
+	return 0;
+}
+
+/*
+ * Send a regular file, given by its path or by a file descriptor, as a
+ * binary message: ws:sendfile(file[, offset[, length]]).  The length
+ * defaults to the rest of the file.  The message is never compressed.
+ */
+static int
+websocket_sendfile(lua_State *L)
+{
+	WEBSOCKET *websock;
+	struct stat sb;
+	lua_Integer offset, len;
+	const char *path;
+	int fd, *fdp;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	offset = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, offset >= 0, 3, "negative offset");
+	if (!lua_isnoneornil(L, 4))
+		luaL_argcheck(L, luaL_checkinteger(L, 4) >= 0, 4,
+		    "negative length");
+	websocket_active(websock);
+	lua_settop(L, 4);
+
+	/* A path is opened once, the send may continue after yielding */
+	if (lua_type(L, 2) == LUA_TNUMBER)
+		fd = (int)luaL_checkinteger(L, 2);
+	else {
+		path = luaL_checkstring(L, 2);
+		fdp = lua_newuserdata(L, sizeof(int));
+		*fdp = -1;
+		luaL_getmetatable(L, SENDFILE_METATABLE);
+		lua_setmetatable(L, -2);
+		if ((*fdp = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			return luaL_error(L, "can't open %s: %s", path,
+			    strerror(errno));
+		fd = *fdp;
+		lua_replace(L, 2);
+	}
+
+	if (lua_isnil(L, 4)) {
+		if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+			sendfile_done(L);
+			return luaL_argerror(L, 4, "length required");
+		}
+		len = sb.st_size > offset ? sb.st_size - offset : 0;
+	} else
+		len = lua_tointeger(L, 4);
+
+	/* The frame header is fixed, so is the length once it is known */
+	lua_settop(L, 2);
+	lua_pushinteger(L, offset);
+	lua_pushinteger(L, len);
+	lua_pushinteger(L, -1);
+	lua_pushinteger(L, 0);
+	return websocket_sendfilek(L, LUA_OK, 6);
+}
+
+/*
+ * Compress a message once for all clients.  The frame is compressed without
+ * context takeover, so any client that negotiated permessage-deflate with a
+ * window at least as large can inflate it.
+ */
+static struct wsDeflater *
+frame_deflate(lua_State *L, int arg, const char *data, size_t datasize,
+    enum wsFrameType type)
+{
+	struct wsDeflateParams params;
+	struct wsDeflater *deflater;
+	lua_Integer threshold;
+
+	wsDefaultDeflate(&params);
+	if (lua_istable(L, arg)) {
+		params.level = websocket_optint(L, arg, "level", params.level);
+		luaL_argcheck(L, params.level >= -1 && params.level <= 9, arg,
+		    "invalid level");
+		params.memLevel = websocket_optint(L, arg, "memlevel",
+		    params.memLevel);
+		luaL_argcheck(L, params.memLevel >= 1 && params.memLevel <= 9,
+		    arg, "invalid memlevel");
+		params.serverMaxWindowBits = websocket_optint(L, arg,
+		    "windowbits", params.serverMaxWindowBits);
+		luaL_argcheck(L, params.serverMaxWindowBits >= 9 &&
+		    params.serverMaxWindowBits <= 15, arg,
+		    "invalid windowbits");
+		threshold = websocket_optint(L, arg, "threshold",
+		    params.threshold);
+		luaL_argcheck(L, threshold >= 0, arg, "negative threshold");
+		params.threshold = threshold;
+	}
+	if (datasize < params.threshold)
+		return NULL;
+	params.serverNoContextTakeover = 1;
+	params.threshold = 0;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, SHARED_DEFLATER);
+	deflater = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	wsSetDeflater(deflater, &params);
+	deflater->buflen = 0;
+	if (wsDeflateFrame(deflater, (const uint8_t *)data, datasize, type))
+		luaL_error(L, "compression error");
+	return deflater;
+}
+
+/*
+ * Encode the message given by the arguments data [, type [, compress]]
+ * starting at arg into a new frame.  If compress is true or a table of
+ * compression parameters, a compressed variant is added that is sent to
+ * connections that negotiated permessage-deflate.
+ */
+static FRAME *
+frame_new(lua_State *L, int arg)
+{
+	FRAME *frame;
+	const char *data;
+	size_t datasize, hdrlen, zlen;
+	unsigned char hdr[WS_MAX_HEADER];
+	struct wsDeflater *deflater;
+	enum wsFrameType type;
+
+	data = luaL_checklstring(L, arg, &datasize);
+	type = frame_opcodes[luaL_checkoption(L, arg + 1, "text",
+	    frame_types)];
+	hdrlen = wsMakeFrameHeader(datasize, hdr, type);
+
+	deflater = NULL;
+	if (lua_toboolean(L, arg + 2))
+		deflater = frame_deflate(L, arg + 2, data, datasize, type);
+
+	/* Only keep the compressed frame if it is smaller */
+	zlen = 0;
+	if (deflater != NULL && deflater->buflen < hdrlen + datasize)
+		zlen = deflater->buflen;
+
+	if ((frame = frame_alloc(hdrlen + datasize + zlen)) == NULL) {
+		luaL_error(L, "memory error");
+		return NULL;
+	}
+	frame->len = hdrlen + datasize;
+	frame->zlen = zlen;
+	frame->zbits = zlen > 0 ? deflater->windowBits : 0;
+	memcpy(frame->data, hdr, hdrlen);
+	memcpy(frame->data + hdrlen, data, datasize);
+	if (zlen > 0)
+		memcpy(frame->data + frame->len, deflater->buf, zlen);
+	return frame;
+}
+
+/*
+ * Create a frame that can be sent to many connections, websocket.frame(data
+ * [, type [, compress]]).
+ */
+static int
+websocket_frame(lua_State *L)
+{
+	FRAME **frame;
+
+	frame = lua_newuserdata(L, sizeof(FRAME *));
+	*frame = NULL;
+	luaL_getmetatable(L, FRAME_METATABLE);
+	lua_setmetatable(L, -2);
+	*frame = frame_new(L, 1);
+	return 1;
+}
+
+/*
+ * Select the variant of a frame to send on a connection.  After a message
+ * compressed for all clients, the connection's own compression context is
+ * no longer valid.
+ */
+static void
+frame_select(WEBSOCKET *websock, FRAME *frame, struct iovec *iov)
+{
+	if (frame->zlen > 0 && websock->deflater.windowBits >= frame->zbits) {
+		iov->iov_base = frame->data + frame->len;
+		iov->iov_len = frame->zlen;
+		wsResetDeflater(&websock->deflater);
+	} else {
+		iov->iov_base = frame->data;
+		iov->iov_len = frame->len;
+	}
+}
+
+/* The deflater used by websocket.frame() */
+static int
+deflater_clear(lua_State *L)
+{
+	freeDeflater(luaL_checkudata(L, 1, DEFLATER_METATABLE));
+	return 0;
+}
+
+static int
+frame_len(lua_State *L)
+{
+	FRAME **frame;
+
+	frame = luaL_checkudata(L, 1, FRAME_METATABLE);
+	lua_pushinteger(L, (*frame)->len);
+	return 1;
+}
+
+static int
+frame_clear(lua_State *L)
+{
+	FRAME **frame;
+
+	frame = luaL_checkudata(L, 1, FRAME_METATABLE);
+	if (*frame != NULL) {
+		frame_unref(*frame);
+		*frame = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Send a frame, ws:sendframe(frame[, key]), returns like ws:send().  On
+ * connections with an output queue the frame is queued without copying it.
+ */
+static int
+websocket_sendframe(lua_State *L)
+{
+	WEBSOCKET *websock;
+	FRAME **frame;
+	struct iovec iov;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	frame = luaL_checkudata(L, 2, FRAME_METATABLE);
+
+	frame_select(websock, *frame, &iov);
+	if (websock->queueing) {
+		lua_pushboolean(L, queue_message(websock, &iov, 1, *frame,
+		    luaL_optinteger(L, 3, 0)) == 1);
+		return 1;
+	}
+	return websocket_sent(L, websock, websocket_output(websock, &iov, 1,
+	    !websocket_canyield(L, websock)));
+}
+
+/*
+ * Send a frame to all connections in an array, websocket.broadcast(frame,
+ * conns[, key]), returns the number of connections it was written or
+ * queued to.
+ */
+static int
+websocket_broadcast(lua_State *L)
+{
+	WEBSOCKET *websock;
+	FRAME **frame;
+	struct iovec iov;
+	lua_Integer n, nconns, nsent, key;
+	unsigned long dropped;
+
+	frame = luaL_checkudata(L, 1, FRAME_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	key = luaL_optinteger(L, 3, 0);
+
+	nconns = luaL_len(L, 2);
+	for (nsent = 0, n = 1; n <= nconns; n++) {
+		lua_rawgeti(L, 2, n);
+		websock = luaL_testudata(L, -1, WEBSOCKET_METATABLE);
+		lua_pop(L, 1);
+		if (websock == NULL || websock->socket == -1)
+			continue;
+		frame_select(websock, *frame, &iov);
+		if (websock->queueing) {
+			dropped = websock->qdropped;
+			if (queue_message(websock, &iov, 1, *frame, key) != -1 &&
+			    websock->qdropped == dropped)
+				nsent++;
+		} else if (!websock->corked &&
+		    (websock->suspended || websock->qhead != NULL)) {
+			/*
+			 * Behind a message that is written in part, it goes
+			 * out when the socket takes the queue.
+			 */
+			if (queue_append(websock, &iov, 1, *frame, 0) == 1)
+				nsent++;
+		} else if (websocket_output(websock, &iov, 1, 0) != -1) {
+			/* What the socket does not take now is queued */
+			nsent++;
+		}
+	}
+	lua_pushinteger(L, nsent);
+	return 1;
+}
+
+/* Create a publish/subscribe hub, websocket.hub() */
+static int
+websocket_hub(lua_State *L)
+{
+	HUB *hub;
+
+	hub = lua_newuserdata(L, sizeof(HUB));
+	LIST_INIT(&hub->topics);
+	LIST_INIT(&hub->dirty);
+	hub->corked = 0;
+	hub->names = LUA_NOREF;
+	luaL_getmetatable(L, HUB_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	hub->names = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+/* Look up the topic named by the string at index arg */
+static TOPIC *
+hub_topic(lua_State *L, HUB *hub, int arg)
+{
+	TOPIC *topic;
+
+	if (hub->names == LUA_NOREF)
+		return NULL;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, hub->names);
+	lua_pushvalue(L, arg);
+	lua_rawget(L, -2);
+	topic = lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	return topic;
+}
+
+/* The subscription of a connection to a topic */
+static SUBSCRIPTION *
+hub_subscription(WEBSOCKET *websock, TOPIC *topic)
+{
+	SUBSCRIPTION *sub;
+
+	LIST_FOREACH(sub, &websock->subs, connsubs)
+		if (sub->topic == topic)
+			return sub;
+	return NULL;
+}
+
+/*
+ * Subscribe a connection to a topic, hub:subscribe(ws, topic).  Returns
+ * false if it already was subscribed.
+ */
+static int
+hub_subscribe(lua_State *L)
+{
+	HUB *hub;
+	WEBSOCKET *websock;
+	TOPIC *topic;
+	SUBSCRIPTION *sub;
+	const char *name;
+	size_t namelen;
+
+	hub = luaL_checkudata(L, 1, HUB_METATABLE);
+	websock = luaL_checkudata(L, 2, WEBSOCKET_METATABLE);
+	name = luaL_checklstring(L, 3, &namelen);
+	luaL_argcheck(L, websock->socket != -1, 2, "closed connection");
+	luaL_argcheck(L, hub->names != LUA_NOREF, 1, "closed hub");
+
+	topic = hub_topic(L, hub, 3);
+	if (topic != NULL && hub_subscription(websock, topic) != NULL) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if ((sub = malloc(sizeof(SUBSCRIPTION))) == NULL)
+		return luaL_error(L, "memory error");
+	if (topic == NULL) {
+		if ((topic = malloc(sizeof(TOPIC) + namelen)) == NULL) {
+			free(sub);
+			return luaL_error(L, "memory error");
+		}
+		topic->hub = hub;
+		LIST_INIT(&topic->subs);
+		topic->nsubs = 0;
+		topic->namelen = namelen;
+		memcpy(topic->name, name, namelen);
+		LIST_INSERT_HEAD(&hub->topics, topic, entries);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, hub->names);
+		lua_pushvalue(L, 3);
+		lua_pushlightuserdata(L, topic);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	sub->topic = topic;
+	sub->websock = websock;
+	sub->dirty = 0;
+	LIST_INSERT_HEAD(&topic->subs, sub, topicsubs);
+	LIST_INSERT_HEAD(&websock->subs, sub, connsubs);
+	topic->nsubs++;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Unsubscribe a connection from a topic or, without a topic, from all
+ * topics of the hub, hub:unsubscribe(ws [, topic]).  Returns false if it
+ * was not subscribed.
+ */
+static int
+hub_unsubscribe(lua_State *L)
+{
+	HUB *hub;
+	WEBSOCKET *websock;
+	TOPIC *topic;
+	SUBSCRIPTION *sub, *next;
+	int found = 0;
+
+	hub = luaL_checkudata(L, 1, HUB_METATABLE);
+	websock = luaL_checkudata(L, 2, WEBSOCKET_METATABLE);
+
+	if (lua_isnoneornil(L, 3)) {
+		for (sub = LIST_FIRST(&websock->subs); sub != NULL;
+		    sub = next) {
+			next = LIST_NEXT(sub, connsubs);
+			if (sub->topic->hub == hub) {
+				subscription_remove(L, sub);
+				found = 1;
+			}
+		}
+	} else {
+		luaL_checkstring(L, 3);
+		if ((topic = hub_topic(L, hub, 3)) != NULL &&
+		    (sub = hub_subscription(websock, topic)) != NULL) {
+			subscription_remove(L, sub);
+			found = 1;
+		}
+	}
+	lua_pushboolean(L, found);
+	return 1;
+}
+
+/* Write out the queue of a subscriber, unless its output is held back */
+static void
+hub_flush(WEBSOCKET *websock)
+{
+	if (websock->socket != -1 && !websock->corked && !websock->suspended)
+		queue_flush(websock, 0);
+}
+
+/*
+ * Publish a message to the subscribers of a topic, hub:publish(topic, data
+ * [, type [, compress]]) or hub:publish(topic, frame).  The message is
+ * framed once and the frame is added to the output queue of each
+ * subscriber, which is then written out, together with what was queued
+ * before, with one writev().  Queues of connections with a poller that
+ * were not empty are left to the poller, which waits for them to become
+ * writable.  While the hub is corked, nothing is written until
+ * hub:uncork().  Write errors are left to be seen by the connection.
+ * Returns the number of subscribers the message was queued to.
+ */
+static int
+hub_publish(lua_State *L)
+{
+	HUB *hub;
+	TOPIC *topic;
+	SUBSCRIPTION *sub;
+	WEBSOCKET *websock;
+	FRAME **fp, *frame;
+	struct iovec iov;
+	lua_Integer nsent;
+	int waiting;
+
+	hub = luaL_checkudata(L, 1, HUB_METATABLE);
+	luaL_checkstring(L, 2);
+	if ((topic = hub_topic(L, hub, 2)) == NULL) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	if ((fp = luaL_testudata(L, 3, FRAME_METATABLE)) != NULL) {
+		luaL_argcheck(L, *fp != NULL, 3, "cleared frame");
+		frame = *fp;
+		frame->refcount++;
+	} else
+		frame = frame_new(L, 3);
+
+	nsent = 0;
+	LIST_FOREACH(sub, &topic->subs, topicsubs) {
+		websock = sub->websock;
+		waiting = websock->qhead != NULL && websock->poller != NULL;
+		frame_select(websock, frame, &iov);
+		if (queue_append(websock, &iov, 1, frame, 0) != 1)
+			continue;
+		nsent++;
+		if (hub->corked) {
+			if (!sub->dirty) {
+				sub->dirty = 1;
+				LIST_INSERT_HEAD(&hub->dirty, sub, dirties);
+			}
+		} else if (!waiting)
+			hub_flush(websock);
+	}
+	frame_unref(frame);
+	lua_pushinteger(L, nsent);
+	return 1;
+}
+
+/* Number of subscribers of a topic, hub:subscribers(topic) */
+static int
+hub_subscribers(lua_State *L)
+{
+	HUB *hub;
+	TOPIC *topic;
+
+	hub = luaL_checkudata(L, 1, HUB_METATABLE);
+	luaL_checkstring(L, 2);
+	topic = hub_topic(L, hub, 2);
+	lua_pushinteger(L, topic != NULL ? topic->nsubs : 0);
+	return 1;
+}
+
+/*
+ * Hold back writing while several messages are published, so each
+ * subscriber gets them with one write.
+ */
+static int
+hub_cork(lua_State *L)
+{
+	HUB *hub;
+
+	hub = luaL_checkudata(L, 1, HUB_METATABLE);
+	hub->corked = 1;
+	return 0;
+}
+
+static int
+hub_uncork(lua_State *L)
+{
+	HUB *hub;
+	SUBSCRIPTION *sub;
+
+	hub = luaL_checkudata(L, 1, HUB_METATABLE);
+	hub->corked = 0;
+	while ((sub = LIST_FIRST(&hub->dirty)) != NULL) {
+		LIST_REMOVE(sub, dirties);
+		sub->dirty = 0;
+		hub_flush(sub->websock);
+	}
+	return 0;
+}
+
+/* Topics exist while they have subscribers, this removes them all */
+static int
+hub_clear(lua_State *L)
+{
+	HUB *hub;
+	TOPIC *topic;
+
+	hub = luaL_checkudata(L, 1, HUB_METATABLE);
+	while ((topic = LIST_FIRST(&hub->topics)) != NULL)
+		subscription_remove(L, LIST_FIRST(&topic->subs));
+	luaL_unref(L, LUA_REGISTRYINDEX, hub->names);
+	hub->names = LUA_NOREF;
+	return 0;
+}
+
+static int
+websocket_cork(lua_State *L)
+{
+	WEBSOCKET *websock;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	websock->corked = 1;
+	return 0;
+}
+
+/* Write out what was sent while corked, returns like ws:send() */
+static int
+websocket_uncork(lua_State *L)
+{
+	WEBSOCKET *websock;
+	int ret;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	websock->corked = 0;
+	if ((ret = websocket_flush(websock,
+	    !websocket_canyield(L, websock))) != 0)
+		return websocket_sent(L, websock, ret);
+
+	/* Queued messages are written as far as the socket takes them */
+	if (websock->qhead != NULL && !websock->suspended &&
+	    queue_flush(websock, !websock->queueing &&
+	    !websocket_canyield(L, websock)) == -1)
+		return websocket_sent(L, websock, -1);
+	return websocket_sent(L, websock, 0);
+}
+
+/*
+ * Configure the output queue, ws:queue([opts]).  With a table, messages
+ * are queued and written when the socket is writable instead of waiting
+ * for it; opts.high (1 MB) and opts.low (a quarter of high) are the
+ * watermarks in bytes and if opts.drop is set, messages are dropped while
+ * the queue is above the high watermark.  false turns queueing off, frames
+ * already queued are still written.  On a listener the settings apply to
+ * accepted connections.  Returns the number of bytes queued and the number
+ * of messages dropped.
+ */
+static int
+websocket_queue(lua_State *L)
+{
+	WEBSOCKET *websock;
+	int high;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	if (lua_istable(L, 2)) {
+		high = websocket_optint(L, 2, "high", QUEUE_HIGH);
+		luaL_argcheck(L, high > 0, 2, "high watermark must be positive");
+		websock->qhigh = high;
+		websock->qlow = websocket_optint(L, 2, "low", high / 4);
+		luaL_argcheck(L, websock->qlow <= websock->qhigh, 2,
+		    "low watermark above high watermark");
+		websock->qdrop = websocket_optbool(L, 2, "drop");
+		websock->queueing = 1;
+	} else if (lua_gettop(L) > 1 && !lua_toboolean(L, 2))
+		websock->queueing = 0;
+	lua_pushinteger(L, websock->qlen);
+	lua_pushinteger(L, websock->qdropped);
+	return 2;
+}
+
+static int websocket_drain(lua_State *);
+
+static int
+websocket_draink(lua_State *L, int status, lua_KContext ctx)
+{
+	lua_settop(L, ctx);
+	return websocket_drain(L);
+}
+
+/*
+ * Wait until the output queue is at or below its low watermark, returns
+ * false if the connection failed.
+ */
+static int
+websocket_drain(lua_State *L)
+{
+	WEBSOCKET *websock;
+	int ret;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	while (websock->qlen > websock->qlow) {
+		if (websock->socket == -1) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if (websock->suspended)
+			ret = 1;
+		else if ((ret = queue_flush(websock,
+		    !websocket_canyield(L, websock))) == -1) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if (ret == 1 && websock->qlen > websock->qlow) {
+			if (!websocket_canyield(L, websock)) {
+				if (websocket_wait(websock, POLLOUT)) {
+					lua_pushboolean(L, 0);
+					return 1;
+				}
+				continue;
+			}
+			return websocket_yield(L, 1, "w", lua_gettop(L),
+			    websocket_draink);
+		}
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+websocket_maxsize(lua_State *L)
+{
+	WEBSOCKET *websock;
+	lua_Integer maxsize;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	lua_pushinteger(L, websock->reader.maxMessageSize);
+	if (lua_gettop(L) > 2) {
+		maxsize = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, maxsize >= 0, 2, "negative size");
+		websock->reader.maxMessageSize = maxsize;
+	}
+	return 1;
+}
+
+/*
+ * Configure permessage-deflate for connections accepted from a listening
+ * socket or for the handshake of a connection.  After the handshake it
+ * returns whether the extension was negotiated.
+ */
+static int
+websocket_deflate(lua_State *L)
+{
+	WEBSOCKET *websock;
+	struct wsDeflateParams params;
+	lua_Integer threshold;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	lua_pushboolean(L, websock->deflate.enabled);
+	if (lua_gettop(L) > 2) {
+		wsDefaultDeflate(&params);
+		if (lua_istable(L, 2)) {
+			params.level = websocket_optint(L, 2, "level",
+			    params.level);
+			luaL_argcheck(L, params.level >= -1 &&
+			    params.level <= 9, 2, "invalid level");
+			params.memLevel = websocket_optint(L, 2, "memlevel",
+			    params.memLevel);
+			luaL_argcheck(L, params.memLevel >= 1 &&
+			    params.memLevel <= 9, 2, "invalid memlevel");
+			params.serverMaxWindowBits = websocket_optint(L, 2,
+			    "windowbits", params.serverMaxWindowBits);
+			luaL_argcheck(L, params.serverMaxWindowBits >= 9 &&
+			    params.serverMaxWindowBits <= 15, 2,
+			    "invalid windowbits");
+			params.clientMaxWindowBits = websocket_optint(L, 2,
+			    "clientwindowbits", params.clientMaxWindowBits);
+			luaL_argcheck(L, params.clientMaxWindowBits >= 8 &&
+			    params.clientMaxWindowBits <= 15, 2,
+			    "invalid clientwindowbits");
+			params.serverNoContextTakeover = websocket_optbool(L,
+			    2, "notakeover");
+			params.clientNoContextTakeover = websocket_optbool(L,
+			    2, "clientnotakeover");
+			threshold = websocket_optint(L, 2, "threshold",
+			    params.threshold);
+			luaL_argcheck(L, threshold >= 0, 2,
+			    "negative threshold");
+			params.threshold = threshold;
+		} else
+			params.enabled = lua_toboolean(L, 2);
+		websock->deflate = params;
+	}
+	return 1;
+}
+
+static int
+websocket_blocking(lua_State *L)
+{
+	WEBSOCKET *websock;
+	int nonblocking;
+
+	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
+	lua_pushboolean(L, !websock->nonblocking);
+	if (lua_gettop(L) > 2) {
+		nonblocking = !lua_toboolean(L, 2);
+
+		/* The eventfd of a TLS pool is only read when signalled */
+		if (websock->pool == NULL &&
+		    websocket_setnonblocking(websock->socket, nonblocking))
+			return luaL_error(L, "can't set blocking mode");
+		websock->nonblocking = nonblocking;
+	}
+	return 1;
+}
+
+#ifdef __linux__
+static uint32_t
+poller_events(lua_State *L, int arg)
+{
+	const char *mode;
+	uint32_t events = 0;
+
+	mode = luaL_optstring(L, arg, "r");
+	for (; *mode; mode++) {
+		switch (*mode) {
+		case 'r':
+			events |= EPOLLIN;
+			break;
+		case 'w':
+			events |= EPOLLOUT;
+			break;
+		default:
+			return luaL_argerror(L, arg, "invalid event mode");
+		}
+	}
+	return events;
+}
+
+/*
+ * Create a poller.  With the option uring = true it uses io_uring if the
+ * kernel supports it (Linux 5.19 or newer) and epoll otherwise.  The size
+ * of the submission queue, the number of receive buffers, a power of two,
+ * and their size can be set with entries, buffers and bufsize.
+ */
+static int
+websocket_poller(lua_State *L)
+{
+	POLLER *poller;
+	struct uring *ring;
+	int opts, entries, nbufs, bufsize;
+
+	opts = lua_istable(L, 1) ? 1 : 0;
+	entries = websocket_optint(L, opts, "entries", URING_ENTRIES);
+	nbufs = websocket_optint(L, opts, "buffers", URING_BUFFERS);
+	bufsize = websocket_optint(L, opts, "bufsize", URING_BUFSIZE);
+	luaL_argcheck(L, entries > 0, 1, "invalid number of entries");
+	luaL_argcheck(L, nbufs > 0 && nbufs <= 32768 &&
+	    (nbufs & (nbufs - 1)) == 0, 1, "invalid number of buffers");
+	luaL_argcheck(L, bufsize > 0, 1, "invalid buffer size");
+
+	poller = lua_newuserdata(L, sizeof(POLLER));
+	LIST_INIT(&poller->conns);
+	LIST_INIT(&poller->pending);
+	LIST_INIT(&poller->waking);
+	LIST_INIT(&poller->uconns);
+	LIST_INIT(&poller->ready);
+	LIST_INIT(&poller->dirty);
+	poller->nwaiting = 0;
+	poller->runq = LUA_NOREF;
+	poller->keepalive = 0;
+	wheel_init(&poller->wheel, 0);
+	poller->norecv = poller->noaccept = 0;
+	poller->ring = NULL;
+	poller->epfd = -1;
+	if (websocket_optbool(L, opts, "uring") &&
+	    (ring = malloc(sizeof(struct uring))) != NULL) {
+		if (uring_init(ring, entries, nbufs, bufsize) == 0)
+			poller->ring = ring;
+		else
+			free(ring);
+	}
+	if (poller->ring == NULL &&
+	    (poller->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return luaL_error(L, "can't create poller: %s",
+		    strerror(errno));
+	luaL_getmetatable(L, POLLER_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	poller->runq = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+/*
+ * The events a connection is waited for: those it was added with, those
+ * coroutines wait for and writability while its output queue is not empty.
+ */
+static uint32_t
+poller_interest(WEBSOCKET *websock)
+{
+	uint32_t events;
+
+	events = websock->events;
+	if (websock->rthread)
+		events |= EPOLLIN;
+	if (websock->wthread || websock->qhead != NULL)
+		events |= EPOLLOUT;
+	return events;
+}
+
+/* Update the interest of a connection that is in a poller */
+static int
+poller_modify(POLLER *poller, WEBSOCKET *websock)
+{
+	struct epoll_event ev;
+
+	ev.events = poller_interest(websock);
+	ev.data.ptr = websock;
+	if (poller->ring == NULL && ev.events != websock->interest &&
+	    epoll_ctl(poller->epfd, EPOLL_CTL_MOD, websock->socket, &ev))
+		return -1;
+	websock->interest = ev.events;
+	if (websock->uconn != NULL)
+		poller_umod(poller, websock->uconn);
+	return 0;
+}
+
+/*
+ * Register the events requested by the user and by waiting coroutines.  If
+ * the connection is not registered yet, its userdata must be at index idx.
+ */
+static int
+poller_update(lua_State *L, POLLER *poller, WEBSOCKET *websock, int idx)
+{
+	struct epoll_event ev;
+
+	ev.events = poller_interest(websock);
+	ev.data.ptr = websock;
+
+	if (websock->poller == NULL) {
+		if (websock->socket == -1)
+			return -1;
+		if (poller->ring != NULL) {
+			if (poller_uadd(poller, websock))
+				return -1;
+		} else if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD,
+		    websock->socket, &ev))
+			return -1;
+		websock->poller = poller;
+		LIST_INSERT_HEAD(&poller->conns, websock, entries);
+		keepalive_start(poller, websock);
+
+		lua_getfield(L, LUA_REGISTRYINDEX, CONNECTIONS_TABLE);
+		lua_pushvalue(L, idx < 0 ? idx - 1 : idx);
+		lua_rawsetp(L, -2, websock);
+		lua_pop(L, 1);
+	} else if (websock->poller != poller)
+		return -1;
+	else
+		return poller_modify(poller, websock);
+	websock->interest = ev.events;
+	if (websock->uconn != NULL)
+		poller_umod(poller, websock->uconn);
+	return 0;
+}
+
+static int
+poller_add(lua_State *L)
+{
+	POLLER *poller;
 	WEBSOCKET *websock;
 
-	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
-	buf = malloc(BUFSIZE);
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	websock = luaL_checkudata(L, 2, WEBSOCKET_METATABLE);
 
-	data = luaL_checklstring(L, 2, &datasize);
-	wsMakeFrame((const uint8_t *)data, datasize, (unsigned char *)buf,
-	    &framesize, WS_TEXT_FRAME);
-	if (websock->ssl)
-		SSL_write(websock->ssl, buf, framesize);
+	if (websock->poller != NULL)
+		return luaL_error(L, "connection is already registered");
+	if (websock->socket == -1)
+		return luaL_error(L, "connection is closed");
+	websock->events = poller_events(L, 3);
+	if (poller_update(L, poller, websock, 2))
+		return luaL_error(L, "can't register connection: %s",
+		    strerror(errno));
+	return 0;
+}
+
+static int
+poller_mod(lua_State *L)
+{
+	POLLER *poller;
+	WEBSOCKET *websock;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	websock = luaL_checkudata(L, 2, WEBSOCKET_METATABLE);
+
+	if (websock->poller != poller)
+		return luaL_error(L, "connection is not registered");
+	websock->events = poller_events(L, 3);
+	if (poller_update(L, poller, websock, 2))
+		return luaL_error(L, "can't modify connection: %s",
+		    strerror(errno));
+	return 0;
+}
+
+/*
+ * Resume the coroutine on top of the stack and pop it.  A coroutine that
+ * yields a connection and "r" or "w" waits until the connection is ready,
+ * behind those already waiting on it, one that yields anything else is run
+ * again on the next iteration of the scheduler.  Errors are passed to the
+ * function at errfunc if it is not 0, otherwise they are raised.
+ */
+static void
+poller_resume(lua_State *L, POLLER *poller, int nargs, int errfunc)
+{
+	lua_State *co;
+	WEBSOCKET *websock;
+	const char *mode;
+	int status, nres, *thread;
+
+	co = lua_tothread(L, -1);
+	status = websocket_resume(co, L, nargs, &nres);
+	switch (status) {
+	case LUA_OK:
+		lua_pop(co, nres);
+		lua_pop(L, 1);
+		break;
+	case LUA_YIELD:
+		websock = NULL;
+		mode = NULL;
+		if (nres >= 2) {
+			websock = luaL_testudata(co, -nres, WEBSOCKET_METATABLE);
+			mode = lua_tostring(co, -nres + 1);
+		}
+		if (websock == NULL || mode == NULL || websock->socket == -1 ||
+		    (strcmp(mode, "r") && strcmp(mode, "w"))) {
+			lua_pop(co, nres);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, poller->runq);
+			lua_insert(L, -2);
+			lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+			lua_pop(L, 1);
+			break;
+		}
+		thread = *mode == 'r' ? &websock->rthread : &websock->wthread;
+		if (*thread != 0) {
+			lua_pop(co, nres);
+			poller_park(L, poller, *mode == 'r' ?
+			    &websock->rparked : &websock->wparked);
+			break;
+		}
+		lua_pushvalue(co, -nres);
+		lua_xmove(co, L, 1);
+		lua_pop(co, nres);
+		lua_insert(L, -2);
+		*thread = luaL_ref(L, LUA_REGISTRYINDEX);
+		poller->nwaiting++;
+		if (poller_update(L, poller, websock, -1))
+			luaL_error(L, "can't register connection: %s",
+			    strerror(errno));
+		lua_pop(L, 1);
+		break;
+	default:
+		lua_xmove(co, L, 1);
+		if (errfunc == 0)
+			lua_error(L);
+		lua_pushvalue(L, errfunc);
+		lua_insert(L, -2);
+		lua_pushvalue(L, -3);
+		lua_call(L, 2, 0);
+		lua_pop(L, 1);
+	}
+}
+
+/* The clock of the keepalive timer wheel, in ticks */
+static uint64_t
+keepalive_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) /
+	    KEEPALIVE_TICK;
+}
+
+/* Arm the timer of a connection for the next thing keepalive has to do */
+static void
+keepalive_schedule(POLLER *poller, WEBSOCKET *websock)
+{
+	uint64_t expires = UINT64_MAX;
+
+	if (websock->pinged)
+		expires = websock->pingsent + poller->katimeout;
+	else if (poller->kainterval)
+		expires = websock->lastrx + poller->kainterval;
+	if (poller->kaidle && websock->lastmsg + poller->kaidle < expires)
+		expires = websock->lastmsg + poller->kaidle;
+	if (expires != UINT64_MAX)
+		wheel_add(&poller->wheel, &websock->katimer, expires);
+}
+
+/* Upgraded connections are kept alive once they are in the poller */
+static void
+keepalive_start(POLLER *poller, WEBSOCKET *websock)
+{
+	if (!poller->keepalive || !websock->established ||
+	    websock->katimer.armed)
+		return;
+	/* The wheel only keeps time while timers are armed */
+	if (poller->wheel.ntimers == 0)
+		poller->wheel.now = keepalive_clock();
+	websock->katimer.arg = websock;
+	websock->lastrx = websock->lastmsg = poller->wheel.now;
+	websock->pinged = 0;
+	keepalive_schedule(poller, websock);
+}
+
+/*
+ * The timer of a connection expired.  Send a ping if there was no input for
+ * the interval, returns "idle" or "timeout" if the connection is dead.
+ * Input only updates lastrx, the timer is moved when it expires.
+ */
+static const char *
+keepalive_check(POLLER *poller, WEBSOCKET *websock)
+{
+	unsigned char ping[2];
+	struct iovec iov;
+	uint64_t now = poller->wheel.now;
+
+	if (poller->kaidle && websock->lastmsg + poller->kaidle <= now)
+		return "idle";
+	if (websock->pinged) {
+		if (websock->lastrx >= websock->pingsent)
+			websock->pinged = 0;
+		else if (websock->pingsent + poller->katimeout <= now)
+			return "timeout";
+	}
+	if (!websock->pinged && poller->kainterval &&
+	    websock->lastrx + poller->kainterval <= now) {
+		/* Written when the socket takes it, after a suspended send */
+		iov.iov_base = ping;
+		iov.iov_len = wsMakeFrameHeader(0, ping, WS_PING_FRAME);
+		if (queue_copy(websock, &iov, 1, 0) == 0 &&
+		    !websock->suspended)
+			queue_flush(websock, 0);
+		websock->pinged = 1;
+		websock->pingsent = now;
+	}
+	keepalive_schedule(poller, websock);
+	return NULL;
+}
+
+/*
+ * Advance the timer wheel and close the connections that are dead.  Those
+ * idle are told they are going away.  Coroutines waiting on them are
+ * resumed.  If conns is not 0, the connections are appended to the table
+ * at that index and their reason to the table at index reasons.
+ */
+static void
+keepalive_expire(lua_State *L, POLLER *poller, int conns, int reasons)
+{
+	struct timerlist expired;
+	struct timer *t;
+	WEBSOCKET *websock;
+	unsigned char goaway[4];
+	struct iovec iov;
+	const char *reason;
+	size_t len;
+	uint16_t status;
+
+	LIST_INIT(&expired);
+	wheel_advance(&poller->wheel, keepalive_clock(), &expired);
+	if (LIST_EMPTY(&expired))
+		return;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CONNECTIONS_TABLE);
+	while ((t = LIST_FIRST(&expired)) != NULL) {
+		LIST_REMOVE(t, entries);
+		websock = t->arg;
+		if ((reason = keepalive_check(poller, websock)) == NULL)
+			continue;
+
+		if (*reason == 'i') {
+			status = htons(1001);
+			wsMakeFrame((uint8_t *)&status, sizeof(status),
+			    goaway, &len, WS_CLOSING_FRAME);
+			iov.iov_base = goaway;
+			iov.iov_len = len;
+			queue_copy(websock, &iov, 1, 0);
+		}
+
+		/* The userdata must not be collected while it is released */
+		lua_rawgetp(L, -1, websock);
+		if (conns) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, conns, lua_rawlen(L, conns) + 1);
+			lua_pushstring(L, reason);
+			lua_rawseti(L, reasons, lua_rawlen(L, reasons) + 1);
+		}
+		websocket_release(L, websock, 1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/* Input that arrived in events, before the timers are looked at */
+static void
+keepalive_input(POLLER *poller, struct epoll_event *events, int nevents)
+{
+	WEBSOCKET *websock;
+	uint64_t now;
+	int n;
+
+	now = keepalive_clock();
+	for (n = 0; n < nevents; n++) {
+		websock = events[n].data.ptr;
+		if (events[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP) &&
+		    websock->katimer.armed)
+			websock->lastrx = now;
+	}
+}
+
+/* Milliseconds the poller may wait before the wheel must advance */
+static int
+keepalive_timeout(POLLER *poller, int timeout)
+{
+	int64_t ticks;
+
+	if (!poller->keepalive ||
+	    (ticks = wheel_next(&poller->wheel)) == -1)
+		return timeout;
+	if (timeout < 0 || ticks * KEEPALIVE_TICK < timeout)
+		return ticks * KEEPALIVE_TICK;
+	return timeout;
+}
+
+/* Resume a coroutine waiting on a connection, those parked run next */
+static void
+poller_wake(lua_State *L, POLLER *poller, WEBSOCKET *websock, int *thread,
+    int *parked, int errfunc)
+{
+	poller_unpark(L, poller, parked);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, *thread);
+	luaL_unref(L, LUA_REGISTRYINDEX, *thread);
+	*thread = 0;
+	poller->nwaiting--;
+	poller_resume(L, poller, 0, errfunc);
+
+	/* Drop the interest unless the coroutine waits again */
+	if (websock->poller == poller)
+		poller_update(L, poller, websock, 0);
+}
+
+/* Run a function as a coroutine under the control of the scheduler */
+static int
+poller_spawn(lua_State *L)
+{
+	POLLER *poller;
+	lua_State *co;
+	int nargs;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	nargs = lua_gettop(L) - 2;
+
+	co = lua_newthread(L);
+	lua_insert(L, 2);
+	lua_xmove(L, co, nargs + 1);
+	poller_resume(L, poller, nargs, 0);
+	return 0;
+}
+
+/*
+ * Run the scheduler until no coroutine is left.  Errors in coroutines are
+ * passed to the optional error handler together with the coroutine.
+ */
+static int
+poller_run(lua_State *L)
+{
+	POLLER *poller;
+	WEBSOCKET *websock, *next;
+	struct epoll_event events[POLLER_MAXEVENTS];
+	int errfunc, nevents, n, nrunnable, timeout, top;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	errfunc = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		errfunc = 2;
+	}
+	lua_settop(L, 2);
+	luaL_checkstack(L, POLLER_MAXEVENTS + 8, "too many events");
+
+	for (;;) {
+		/* Run coroutines that are ready */
+		lua_rawgeti(L, LUA_REGISTRYINDEX, poller->runq);
+		nrunnable = lua_rawlen(L, -1);
+		if (nrunnable > 0) {
+			luaL_unref(L, LUA_REGISTRYINDEX, poller->runq);
+			lua_newtable(L);
+			poller->runq = luaL_ref(L, LUA_REGISTRYINDEX);
+			for (n = 1; n <= nrunnable; n++) {
+				lua_rawgeti(L, -1, n);
+				poller_resume(L, poller, 0, errfunc);
+			}
+		}
+		lua_pop(L, 1);
+
+		/*
+		 * Connections with buffered input and a reader waiting.  They
+		 * are moved to a list of their own first, the coroutines that
+		 * are resumed may close or add pending connections.  Entries
+		 * stay flagged as pending, so closing removes them from it.
+		 */
+		for (websock = LIST_FIRST(&poller->pending); websock != NULL;
+		    websock = next) {
+			next = LIST_NEXT(websock, pendings);
+			if (websock->rthread) {
+				LIST_REMOVE(websock, pendings);
+				LIST_INSERT_HEAD(&poller->waking, websock,
+				    pendings);
+			}
+		}
+		while ((websock = LIST_FIRST(&poller->waking)) != NULL) {
+			LIST_REMOVE(websock, pendings);
+			websock->pending = 0;
+			if (!websock->rthread)
+				continue;
+			lua_getfield(L, LUA_REGISTRYINDEX, CONNECTIONS_TABLE);
+			lua_rawgetp(L, -1, websock);
+			poller_wake(L, poller, websock, &websock->rthread,
+			    &websock->rparked, errfunc);
+			lua_pop(L, 2);
+		}
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, poller->runq);
+		nrunnable = lua_rawlen(L, -1);
+		lua_pop(L, 1);
+		if (poller->nwaiting == 0 && nrunnable == 0)
+			break;
+
+		/* Do not block while buffered input waits to be read */
+		timeout = nrunnable > 0 ? 0 : keepalive_timeout(poller, -1);
+		LIST_FOREACH(websock, &poller->pending, pendings)
+			if (websock->rthread) {
+				timeout = 0;
+				break;
+			}
+		if ((nevents = poller_poll(poller, events, POLLER_MAXEVENTS,
+		    timeout)) == -1) {
+			if (errno != EINTR)
+				return luaL_error(L, "poller error: %s",
+				    strerror(errno));
+			continue;
+		}
+
+		/* Keep the connections alive while coroutines run */
+		top = lua_gettop(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, CONNECTIONS_TABLE);
+		for (n = 0; n < nevents; n++)
+			lua_rawgetp(L, top + 1, events[n].data.ptr);
+
+		if (poller->keepalive) {
+			keepalive_input(poller, events, nevents);
+			keepalive_expire(L, poller, 0, 0);
+		}
+
+		for (n = 0; n < nevents; n++) {
+			websock = events[n].data.ptr;
+			if (websock->poller != poller)
+				continue;
+			if ((events[n].events & (EPOLLIN | EPOLLERR |
+			    EPOLLHUP)) && websock->rthread) {
+				if (websock->pending) {
+					LIST_REMOVE(websock, pendings);
+					websock->pending = 0;
+				}
+				poller_wake(L, poller, websock,
+				    &websock->rthread, &websock->rparked,
+				    errfunc);
+			}
+			if (websock->poller != poller)
+				continue;
+			if ((events[n].events & EPOLLOUT) &&
+			    websock->qhead != NULL && !websock->suspended)
+				queue_flush(websock, 0);
+			if ((events[n].events & (EPOLLOUT | EPOLLERR |
+			    EPOLLHUP)) && websock->wthread)
+				poller_wake(L, poller, websock,
+				    &websock->wthread, &websock->wparked,
+				    errfunc);
+		}
+		lua_settop(L, top);
+	}
+	return 0;
+}
+
+/*
+ * Keep the upgraded connections of the poller alive, p:keepalive{interval =,
+ * timeout =, idle =}, or stop with false.  A connection without input for
+ * interval seconds is sent a ping and closed if there is still no input
+ * after timeout seconds (the interval by default).  Connections without a
+ * message sent or received for idle seconds are closed with status 1001.
+ * Lua is only involved when a connection is closed: poller:wait() reports
+ * it, coroutines waiting on it are resumed.
+ */
+static int
+poller_keepalive(lua_State *L)
+{
+	POLLER *poller;
+	WEBSOCKET *websock;
+	int interval, timeout, idle;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	LIST_FOREACH(websock, &poller->conns, entries)
+		wheel_del(&poller->wheel, &websock->katimer);
+	poller->keepalive = 0;
+	if (!lua_istable(L, 2))
+		return 0;
+
+	interval = websocket_optint(L, 2, "interval", 0);
+	timeout = websocket_optint(L, 2, "timeout", interval);
+	idle = websocket_optint(L, 2, "idle", 0);
+	luaL_argcheck(L, interval >= 0 && timeout >= 0 && idle >= 0, 2,
+	    "negative time");
+	luaL_argcheck(L, interval == 0 || timeout > 0, 2, "timeout required");
+	poller->kainterval = (uint64_t)interval * 1000 / KEEPALIVE_TICK;
+	poller->katimeout = (uint64_t)timeout * 1000 / KEEPALIVE_TICK;
+	poller->kaidle = (uint64_t)idle * 1000 / KEEPALIVE_TICK;
+	poller->keepalive = interval > 0 || idle > 0;
+	LIST_FOREACH(websock, &poller->conns, entries)
+		keepalive_start(poller, websock);
+	return 0;
+}
+
+/* Return the mechanism the poller uses, "io_uring" or "epoll" */
+static int
+poller_backend(lua_State *L)
+{
+	POLLER *poller;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	if (poller->ring != NULL)
+		lua_pushliteral(L, "io_uring");
+	else
+		lua_pushliteral(L, "epoll");
+	return 1;
+}
+
+static int
+poller_del(lua_State *L)
+{
+	POLLER *poller;
+	WEBSOCKET *websock;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	websock = luaL_checkudata(L, 2, WEBSOCKET_METATABLE);
+	if (websock->poller == poller)
+		poller_remove(L, websock);
+	return 0;
+}
+
+/*
+ * Wait for events, returns an array of connections and an array of the
+ * corresponding events ("r", "w" or "rw").  Connections with input that
+ * is already buffered in user space are reported as readable right away.
+ * With keepalive, connections it closed are reported with the reason.
+ */
+static int
+poller_wait(lua_State *L)
+{
+	POLLER *poller;
+	WEBSOCKET *websock;
+	struct epoll_event stackevents[POLLER_MAXEVENTS], *events;
+	int timeout, maxevents, nevents, n, nready;
+	uint32_t ev;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	timeout = luaL_optinteger(L, 2, -1);
+	maxevents = luaL_optinteger(L, 3, POLLER_MAXEVENTS);
+	luaL_argcheck(L, maxevents > 0, 3, "must be positive");
+
+	if (maxevents <= POLLER_MAXEVENTS)
+		events = stackevents;
 	else
-		send(websock->socket, buf, framesize, 0);
-	free(buf);
+		events = lua_newuserdata(L, maxevents * sizeof(*events));
+
+	if (!LIST_EMPTY(&poller->pending))
+		timeout = 0;
+	timeout = keepalive_timeout(poller, timeout);
+	if ((nevents = poller_poll(poller, events, maxevents,
+	    timeout)) == -1) {
+		if (errno != EINTR)
+			return luaL_error(L, "poller error: %s",
+			    strerror(errno));
+		nevents = 0;
+	}
+	if (poller->keepalive)
+		keepalive_input(poller, events, nevents);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CONNECTIONS_TABLE);
+	lua_createtable(L, nevents, 0);
+	lua_createtable(L, nevents, 0);
+	for (nready = 0, n = 0; n < nevents; n++) {
+		websock = events[n].data.ptr;
+		ev = events[n].events;
+
+		/* Writability is only reported if it was asked for */
+		if ((ev & EPOLLOUT) && websock->qhead != NULL &&
+		    !websock->suspended)
+			queue_flush(websock, 0);
+		if (!(websock->events & EPOLLOUT) && !websock->wthread)
+			ev &= ~EPOLLOUT;
+		if (ev == 0 && !websock->pending)
+			continue;
+		if (websock->pending) {
+			LIST_REMOVE(websock, pendings);
+			websock->pending = 0;
+			ev |= EPOLLIN;
+		}
+		if (ev & (EPOLLERR | EPOLLHUP))
+			ev |= EPOLLIN;
+
+		lua_rawgetp(L, -3, websock);
+		lua_rawseti(L, -3, ++nready);
+		if ((ev & EPOLLIN) && (ev & EPOLLOUT))
+			lua_pushliteral(L, "rw");
+		else if (ev & EPOLLOUT)
+			lua_pushliteral(L, "w");
+		else
+			lua_pushliteral(L, "r");
+		lua_rawseti(L, -2, nready);
+	}
+	while ((websock = LIST_FIRST(&poller->pending)) != NULL) {
+		LIST_REMOVE(websock, pendings);
+		websock->pending = 0;
+		lua_rawgetp(L, -3, websock);
+		lua_rawseti(L, -3, ++nready);
+		lua_pushliteral(L, "r");
+		lua_rawseti(L, -2, nready);
+	}
+
+	/* Connections closed by keepalive are reported as "idle" or "timeout" */
+	if (poller->keepalive)
+		keepalive_expire(L, poller, lua_gettop(L) - 1, lua_gettop(L));
+	return 2;
+}
+
+static int
+poller_close(lua_State *L)
+{
+	POLLER *poller;
+	URINGCONN *u;
+
+	poller = luaL_checkudata(L, 1, POLLER_METATABLE);
+	while (!LIST_EMPTY(&poller->conns))
+		poller_remove(L, LIST_FIRST(&poller->conns));
+	if (poller->epfd != -1) {
+		close(poller->epfd);
+		poller->epfd = -1;
+	}
+	if (poller->ring != NULL) {
+		uring_free(poller->ring);
+		free(poller->ring);
+		poller->ring = NULL;
+	}
+	while ((u = LIST_FIRST(&poller->uconns)) != NULL) {
+		LIST_REMOVE(u, entries);
+		free(u);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, poller->runq);
+	poller->runq = LUA_NOREF;
 	return 0;
 }
+#endif
 
 static int
 websocket_socket(lua_State *L)
@@ -300,19 +4222,7 @@ websocket_close(lua_State *L)
 	WEBSOCKET *websock;
 
 	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
-	if (websock->ssl != NULL) {
-		SSL_set_shutdown(websock->ssl,
-		    SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
-		SSL_free(websock->ssl);
-		websock->ssl = NULL;
-	} else if (websock->socket != -1) {
-		close(websock->socket);
-		websock->socket = -1;
-	}
-	if (websock->ctx != NULL) {
-		SSL_CTX_free(websock->ctx);
-		websock->ctx = NULL;
-	}
+	websocket_release(L, websock, 0);
 	return 0;
 }
 
@@ -322,18 +4232,7 @@ websocket_shutdown(lua_State *L)
 	WEBSOCKET *websock;
 
 	websock = luaL_checkudata(L, 1, WEBSOCKET_METATABLE);
-	if (websock->ssl != NULL) {
-		SSL_shutdown(websock->ssl);
-		SSL_free(websock->ssl);
-		websock->ssl = NULL;
-	} else if (websock->socket != -1) {
-		close(websock->socket);
-		websock->socket = -1;
-	}
-	if (websock->ctx != NULL) {
-		SSL_CTX_free(websock->ctx);
-		websock->ctx = NULL;
-	}
+	websocket_release(L, websock, 1);
 	return 0;
 }
 
@@ -342,16 +4241,65 @@ luaopen_websocket(lua_State *L)
 {
 	struct luaL_Reg methods[] = {
 		{ "bind",		websocket_bind },
+		{ "broadcast",		websocket_broadcast },
+		{ "frame",		websocket_frame },
+		{ "hub",		websocket_hub },
+#ifdef __linux__
+		{ "poller",		websocket_poller },
+#endif
 		{ NULL, NULL }
 	};
 	struct luaL_Reg websocket_methods[] = {
 		{ "accept",		websocket_accept },
+		{ "blocking",		websocket_blocking },
 		{ "handshake",		websocket_handshake },
+		{ "maxsize",		websocket_maxsize },
 		{ "close",		websocket_close },
+		{ "deflate",		websocket_deflate },
+		{ "cork",		websocket_cork },
+		{ "drain",		websocket_drain },
 		{ "shutdown",		websocket_shutdown },
+		{ "queue",		websocket_queue },
 		{ "recv", 		websocket_recv},
 		{ "send",		websocket_send },
+		{ "sendfile",		websocket_sendfile },
+		{ "sendframe",		websocket_sendframe },
+		{ "sendv",		websocket_sendv },
 		{ "socket",		websocket_socket },
+		{ "tlsmode",		websocket_tlsmode },
+#ifdef __linux__
+		{ "tlspool",		websocket_tlspool },
+#endif
+		{ "tlsstats",		websocket_tlsstats },
+		{ "uncork",		websocket_uncork },
+		{ NULL, NULL }
+	};
+#ifdef __linux__
+	struct luaL_Reg poller_methods[] = {
+		{ "add",		poller_add },
+		{ "backend",		poller_backend },
+		{ "close",		poller_close },
+		{ "del",		poller_del },
+		{ "keepalive",		poller_keepalive },
+		{ "mod",		poller_mod },
+		{ "run",		poller_run },
+		{ "spawn",		poller_spawn },
+		{ "wait",		poller_wait },
+		{ NULL, NULL }
+	};
+#endif
+	struct luaL_Reg hub_methods[] = {
+		{ "cork",		hub_cork },
+		{ "publish",		hub_publish },
+		{ "subscribe",		hub_subscribe },
+		{ "subscribers",	hub_subscribers },
+		{ "uncork",		hub_uncork },
+		{ "unsubscribe",	hub_unsubscribe },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg frame_methods[] = {
+		{ "__gc",		frame_clear },
+		{ "__len",		frame_len },
 		{ NULL, NULL }
 	};
 	if (luaL_newmetatable(L, WEBSOCKET_METATABLE)) {
@@ -370,6 +4318,76 @@ luaopen_websocket(lua_State *L)
 	}
 	lua_pop(L, 1);
 
+	if (luaL_newmetatable(L, FRAME_METATABLE)) {
+		luaL_setfuncs(L, frame_methods, 0);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, HUB_METATABLE)) {
+		luaL_setfuncs(L, hub_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, hub_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+#ifdef __linux__
+	if (luaL_newmetatable(L, POLLER_METATABLE)) {
+		luaL_setfuncs(L, poller_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, poller_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+#endif
+
+	if (tlsdata_index == -1)
+		tlsdata_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+		    tlsdata_free);
+
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, CONNECTIONS_TABLE);
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, SENDFILE_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, sendfile_close);
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, SHARED_DEFLATER);
+	if (lua_isnil(L, -1)) {
+		nullDeflater(lua_newuserdata(L, sizeof(struct wsDeflater)));
+		if (luaL_newmetatable(L, DEFLATER_METATABLE)) {
+			lua_pushliteral(L, "__gc");
+			lua_pushcfunction(L, deflater_clear);
+			lua_settable(L, -3);
+		}
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, SHARED_DEFLATER);
+	}
+	lua_pop(L, 1);
+
 	luaL_newlib(L, methods);
 	lua_pushliteral(L, "_COPYRIGHT");
 	lua_pushliteral(L, "Copyright (C) 2014 - 2024 by "
@@ -31,17 +31,276 @@
 #define __LUA_WEBSOCKET__
 
 #define WEBSOCKET_METATABLE	"WebSocket methods"
+#define FRAME_METATABLE		"WebSocket frame"
+#define POLLER_METATABLE	"WebSocket poller"
+#define DEFLATER_METATABLE	"WebSocket deflater"
+#define HUB_METATABLE		"WebSocket hub"
+#define SENDFILE_METATABLE	"WebSocket sendfile"
+
+/* Maps WEBSOCKET pointers to their userdata while registered with a poller */
+#define CONNECTIONS_TABLE	"WebSocket connections"
+
+/* Compresses the frames created with websocket.frame() */
+#define SHARED_DEFLATER		"WebSocket shared deflater"
 
 #define LUA_WEBSOCKETLIBNAME	"websocket"
 
 typedef struct websocket {
 	int	 socket;
+	int	 nonblocking;
+
+	/* Read-ahead buffer, kept between calls to recv */
+	struct wsReader reader;
+
+	/* Opening handshake, read into the read-ahead buffer */
+	struct handshake handshake;
+
+	/* permessage-deflate, configured or negotiated */
+	struct wsDeflateParams deflate;
+	struct wsDeflater deflater;
+
+	/* Output held back while the connection is corked */
+	int		 corked;
+	unsigned char	*obuf;
+	size_t		 obufsize;
+	size_t		 obuflen;
+
+	/*
+	 * Set while a file is sent by ws:sendfile(), other output is queued
+	 * behind it.  The token tells the suspended send that owns it.
+	 */
+	int		 suspended;
+	unsigned long	 sendtoken;
+
+	/*
+	 * Frames waiting for the socket to become writable.  What is left of
+	 * a message when the socket would block and output behind it goes
+	 * here, with queueing set all messages do.
+	 */
+	int		 queueing;
+	struct outframe	*qhead;
+	struct outframe	*qtail;
+	size_t		 qlen;		/* bytes still to write */
+	size_t		 qoff;		/* bytes of the head written */
+	size_t		 qinflight;	/* TLS write that must be retried */
+	uint64_t	 qwritten;	/* bytes written from the queue */
+	size_t		 qhigh;		/* watermarks */
+	size_t		 qlow;
+	int		 qdrop;		/* drop messages above qhigh */
+	unsigned long	 qdropped;
 
 	/* For secure websockets */
 	SSL_CTX	*ctx;
 	SSL	*ssl;
+
+	/* Records are encrypted or decrypted by the kernel */
+	int	 ktlstx;
+	int	 ktlsrx;
+
+	/* Listener whose connections are accepted by a thread pool */
+	struct tlspool	*pool;
+	int		 upgraded;	/* handshake done by the pool */
+
+	/* Poller the connection is registered with */
+	struct poller	*poller;
+	struct uringconn *uconn;	/* if the poller uses io_uring */
+	LIST_ENTRY(websocket) entries;
+	uint32_t	 events;	/* requested with add() or mod() */
+	uint32_t	 interest;	/* currently registered */
+
+	/*
+	 * Registry references of coroutines waiting to read or write and of
+	 * tables of further coroutines that wait in the same direction.
+	 */
+	int		 rthread;
+	int		 wthread;
+	int		 rparked;
+	int		 wparked;
+
+	/* Set while on the poller's list of connections with buffered input */
+	int		 pending;
+	LIST_ENTRY(websocket) pendings;
+
+	/* Keepalive by the poller, times are ticks of its timer wheel */
+	int		 established;	/* opening handshake answered */
+	struct timer	 katimer;
+	uint64_t	 lastrx;	/* input arrived */
+	uint64_t	 lastmsg;	/* message sent or received */
+	uint64_t	 pingsent;
+	int		 pinged;	/* no input since the ping */
+
+	/* Topics of hubs the connection is subscribed to */
+	LIST_HEAD(, subscription) subs;
 } WEBSOCKET;
 
+/*
+ * Requests a connection has with an io_uring poller.  Input of plain
+ * connections and new connections of listening sockets are delivered by
+ * multishot requests, the connection is polled for other events.  The
+ * state outlives the connection until the last request has completed.
+ */
+typedef struct uringconn {
+	struct websocket *websock;	/* NULL once removed */
+	int		 inflight;	/* requests that will still complete */
+	int		 pollin;	/* requests pending */
+	int		 pollout;
+	int		 recving;
+	int		 accepting;
+
+	/* Input is received into buffers of the ring */
+	int		 ringfed;
+	int		 unread;	/* received, not yet seen by a read */
+	int		 rxerror;	/* -1 at the end of input, or errno */
+
+	/* Multishot accept, sockets not yet taken by accept() */
+	int		 listener;
+	int		*fds;
+	size_t		 nfds;
+	size_t		 fdsize;
+
+	uint32_t	 revents;	/* to report, epoll flags */
+	int		 ready;
+	int		 dirty;
+	LIST_ENTRY(uringconn) entries;
+	LIST_ENTRY(uringconn) readies;
+	LIST_ENTRY(uringconn) dirties;
+} URINGCONN;
+
+typedef struct poller {
+	int		 epfd;		/* -1 if io_uring is used */
+	LIST_HEAD(, websocket) conns;
+	LIST_HEAD(, websocket) pending;
+	LIST_HEAD(, websocket) waking;	/* pending with a reader to resume */
+
+	/* io_uring backend */
+	struct uring	*ring;
+	LIST_HEAD(, uringconn) uconns;
+	LIST_HEAD(, uringconn) ready;	/* with events to report */
+	LIST_HEAD(, uringconn) dirty;	/* requests to (re)submit */
+	int		 norecv;	/* no multishot receive */
+	int		 noaccept;	/* no multishot accept */
+
+	/* Coroutine scheduler */
+	int		 nwaiting;	/* coroutines waiting on connections */
+	int		 runq;		/* table of coroutines ready to run */
+
+	/* Keepalive of upgraded connections, in ticks, 0 if not used */
+	int		 keepalive;
+	struct wheel	 wheel;
+	uint64_t	 kainterval;	/* ping after this long without input */
+	uint64_t	 katimeout;	/* for the answer to the ping */
+	uint64_t	 kaidle;	/* close without messages */
+} POLLER;
+
+/* Session ticket keys, read from a file shared by worker processes */
+#define TICKET_MAXKEYS		4
+
+typedef struct ticketkey {
+	unsigned char	 name[16];
+	unsigned char	 hmac[32];
+	unsigned char	 aes[32];
+} TICKETKEY;
+
+/* Attached to the SSL context of a secure listener */
+typedef struct tlsdata {
+	/* Completed handshakes */
+	unsigned long	 full;
+	unsigned long	 resumed;
+	unsigned long	 ktls;		/* with kernel TLS for sending */
+
+	/* The first key encrypts new tickets, all keys decrypt */
+	pthread_mutex_t	 lock;		/* taken by handshakes in threads */
+	char		*keyfile;
+	time_t		 keymtime;
+	time_t		 keychecked;
+	int		 nkeys;
+	TICKETKEY	 keys[TICKET_MAXKEYS];
+} TLSDATA;
+
+/*
+ * Threads that accept connections on a secure listener and complete the
+ * TLS handshake, and optionally the opening handshake, with blocking I/O.
+ * Connections that are ready are queued and signalled with an eventfd,
+ * which takes the place of the listening socket in the WEBSOCKET.
+ */
+typedef struct pooledconn {
+	WEBSOCKET	 websock;
+	STAILQ_ENTRY(pooledconn) entries;
+} POOLEDCONN;
+
+typedef struct tlspool {
+	int		 listenfd;
+	int		 efd;
+	SSL_CTX		*ctx;
+	int		 nthreads;
+	pthread_t	*threads;
+	volatile int	 stop;
+
+	/* Settings of the listener, taken when the pool was started */
+	int		 nonblocking;
+	size_t		 maxMessageSize;
+	struct wsDeflateParams deflate;
+	char		*resource;	/* upgrade in the pool if set */
+	int		 timeout;	/* seconds for both handshakes */
+
+	pthread_mutex_t	 lock;
+	STAILQ_HEAD(, pooledconn) done;
+} TLSPOOL;
+
+/*
+ * A server to client frame that is encoded once and sent to many clients,
+ * optionally followed by a compressed variant of the same message for
+ * clients that negotiated permessage-deflate.
+ */
+typedef struct frame {
+	unsigned int	 refcount;
+	size_t		 len;
+	size_t		 zlen;		/* 0 if there is no compressed frame */
+	int		 zbits;		/* window it was compressed with */
+	unsigned char	 data[];
+} FRAME;
+
+/* A frame in the output queue of a connection */
+typedef struct outframe {
+	struct outframe	*next;
+	FRAME		*frame;
+	const unsigned char *data;	/* the variant that is sent */
+	size_t		 len;
+	lua_Integer	 key;		/* superseded by frames with this key */
+} OUTFRAME;
+
+/*
+ * Publish/subscribe hub.  Topics are looked up by name in a table of the
+ * hub and exist while they have subscribers.  A subscription is linked
+ * with both its topic and its connection, so it is removed when either the
+ * hub or the connection goes away.  Connections do not keep a reference
+ * to the hub or the other way round.
+ */
+typedef struct hub {
+	LIST_HEAD(, topic) topics;
+	int		 names;		/* table of topics by name */
+	int		 corked;	/* publish without writing */
+	LIST_HEAD(, subscription) dirty; /* to write when uncorked */
+} HUB;
+
+typedef struct topic {
+	struct hub	*hub;
+	LIST_ENTRY(topic) entries;
+	LIST_HEAD(, subscription) subs;
+	size_t		 nsubs;
+	size_t		 namelen;
+	char		 name[];
+} TOPIC;
+
+typedef struct subscription {
+	struct topic	*topic;
+	struct websocket *websock;
+	LIST_ENTRY(subscription) topicsubs;
+	LIST_ENTRY(subscription) connsubs;
+	int		 dirty;		/* queued to while the hub is corked */
+	LIST_ENTRY(subscription) dirties;
+} SUBSCRIPTION;
+
 extern int luaopen_websocket(lua_State *L);
 
 #endif /* __LUA_WEBSOCKET__ */
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A minimal io_uring for the poller.  liburing is not required, the ring is
+ * set up with the io_uring_setup(2), io_uring_enter(2) and
+ * io_uring_register(2) system calls.  Setup fails if the kernel lacks a
+ * feature the poller relies on, the caller then falls back to epoll.
+ */
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define uring_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define uring_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Required: a single mapping, no dropped completions, enter timeouts */
+#define URING_FEATURES	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | \
+			    IORING_FEAT_EXT_ARG)
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_register(int fd, unsigned int opcode, void *arg, unsigned int nargs)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/*
+ * Set up a ring with room for entries submissions and nbufs receive buffers
+ * of bufsize bytes each.  nbufs must be a power of two.
+ */
+int
+uring_init(struct uring *u, unsigned int entries, unsigned int nbufs,
+    unsigned int bufsize)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned char *ring;
+	unsigned int n;
+	size_t sqsize, cqsize;
+	int error;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+	if ((u->fd = uring_setup(entries, &p)) == -1 && errno == EINVAL) {
+		/* Before Linux 5.19 */
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CLAMP;
+		u->fd = uring_setup(entries, &p);
+	}
+	if (u->fd == -1)
+		return -1;
+	if ((p.features & URING_FEATURES) != URING_FEATURES) {
+		error = ENOSYS;
+		goto fail;
+	}
+
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ringsize = sqsize > cqsize ? sqsize : cqsize;
+	ring = mmap(NULL, u->ringsize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		error = errno;
+		goto fail;
+	}
+	u->ring = ring;
+	u->sqhead = (unsigned int *)(ring + p.sq_off.head);
+	u->sqtail = (unsigned int *)(ring + p.sq_off.tail);
+	u->sqarray = (unsigned int *)(ring + p.sq_off.array);
+	u->sqmask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+	u->sqentries = p.sq_entries;
+	u->cqhead = (unsigned int *)(ring + p.cq_off.head);
+	u->cqtail = (unsigned int *)(ring + p.cq_off.tail);
+	u->cqmask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	u->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqessize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		error = errno;
+		goto fail;
+	}
+
+	/* The buffer ring must be page aligned, Linux 5.19 and newer */
+	u->brsize = nbufs * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->brsize, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		error = errno;
+		goto fail;
+	}
+	if ((u->bufs = malloc((size_t)nbufs * bufsize)) == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+	u->nbufs = nbufs;
+	u->bufsize = bufsize;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = 0;
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		error = errno;
+		goto fail;
+	}
+	for (n = 0; n < nbufs; n++)
+		uring_bufreturn(u, n);
+	return 0;
+
+fail:
+	uring_free(u);
+	errno = error;
+	return -1;
+}
+
+void
+uring_free(struct uring *u)
+{
+	if (u->fd != -1)
+		close(u->fd);
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqessize);
+	if (u->ring != NULL)
+		munmap(u->ring, u->ringsize);
+	if (u->br != NULL)
+		munmap(u->br, u->brsize);
+	free(u->bufs);
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/*
+ * Return a cleared submission queue entry.  If the queue is full, the
+ * pending entries are submitted first.
+ */
+struct io_uring_sqe *
+uring_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	tail = *u->sqtail;
+	if (tail - uring_load(u->sqhead) >= u->sqentries) {
+		if (uring_enter(u, 0, 0) == -1)
+			return NULL;
+		if (tail - uring_load(u->sqhead) >= u->sqentries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	sqe = &u->sqes[tail & u->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqarray[tail & u->sqmask] = tail & u->sqmask;
+	uring_store(u->sqtail, tail + 1);
+	u->sqpending++;
+	return sqe;
+}
+
+/*
+ * Submit pending entries and wait until at least waitnr completions are
+ * available or timeout milliseconds have passed, -1 waits forever.  A
+ * timeout is not an error.
+ */
+int
+uring_enter(struct uring *u, unsigned int waitnr, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags;
+	int ret;
+
+	flags = IORING_ENTER_EXT_ARG;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (waitnr > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+	ret = syscall(__NR_io_uring_enter, u->fd, u->sqpending, waitnr, flags,
+	    &arg, sizeof(arg));
+	if (ret == -1) {
+		if (errno == ETIME)
+			return 0;
+		/* Completions must be reaped before more can be posted */
+		if (errno == EBUSY)
+			return 0;
+		return -1;
+	}
+	u->sqpending -= ret;
+	return 0;
+}
+
+/* Return the next completion or NULL, uring_cqeseen() consumes it */
+struct io_uring_cqe *
+uring_cqe(struct uring *u)
+{
+	unsigned int head;
+
+	head = *u->cqhead;
+	if (head == uring_load(u->cqtail))
+		return NULL;
+	return &u->cqes[head & u->cqmask];
+}
+
+void
+uring_cqeseen(struct uring *u)
+{
+	uring_store(u->cqhead, *u->cqhead + 1);
+}
+
+unsigned char *
+uring_buf(struct uring *u, unsigned int bid)
+{
+	return u->bufs + (size_t)bid * u->bufsize;
+}
+
+/* Hand a receive buffer back to the kernel */
+void
+uring_bufreturn(struct uring *u, unsigned int bid)
+{
+	struct io_uring_buf *buf;
+	unsigned short tail;
+
+	tail = u->br->tail;
+	buf = &u->br->bufs[tail & (u->nbufs - 1)];
+	buf->addr = (unsigned long)uring_buf(u, bid);
+	buf->len = u->bufsize;
+	buf->bid = bid;
+	uring_store(&u->br->tail, tail + 1);
+}
+#endif
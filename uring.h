@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A minimal io_uring, set up with raw system calls */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+struct uring {
+	int			 fd;
+
+	/* Submission queue, entries are published as they are taken */
+	unsigned int		*sqhead;
+	unsigned int		*sqtail;
+	unsigned int		*sqarray;
+	unsigned int		 sqmask;
+	unsigned int		 sqentries;
+	unsigned int		 sqpending;	/* not yet submitted */
+	struct io_uring_sqe	*sqes;
+
+	/* Completion queue */
+	unsigned int		*cqhead;
+	unsigned int		*cqtail;
+	unsigned int		 cqmask;
+	struct io_uring_cqe	*cqes;
+
+	void			*ring;
+	size_t			 ringsize;
+	size_t			 sqessize;
+
+	/* Buffers the kernel picks from when receiving, group 0 */
+	struct io_uring_buf_ring *br;
+	size_t			 brsize;
+	unsigned char		*bufs;
+	unsigned int		 nbufs;
+	unsigned int		 bufsize;
+};
+
+extern int uring_init(struct uring *, unsigned int, unsigned int,
+    unsigned int);
+extern void uring_free(struct uring *);
+extern struct io_uring_sqe *uring_sqe(struct uring *);
+extern int uring_enter(struct uring *, unsigned int, int);
+extern struct io_uring_cqe *uring_cqe(struct uring *);
+extern void uring_cqeseen(struct uring *);
+extern unsigned char *uring_buf(struct uring *, unsigned int);
+extern void uring_bufreturn(struct uring *, unsigned int);
+#endif
+
+#endif /* __URING_H__ */
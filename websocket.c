@@ -22,151 +22,208 @@
  */
 
 #include <openssl/opensslconf.h>
-#include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
 #include <assert.h>
 #include <endian.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WS_HAVE_X86_SIMD
+#endif
 
 #include "base64.h"
 #include "websocket.h"
 
-#define INITIAL_BUFSIZE		256
+/* Size of the per-connection read-ahead buffer */
+#define READAHEAD_SIZE		8192
+
+/* Larger read-ahead buffers are released once they have been drained */
+#define READAHEAD_MAX		(256 * 1024)
+
+/* Payloads are aligned to this boundary before the unmask kernels run */
+#define UNMASK_ALIGN		32
+
+/* Length of the key, the encoding of 16 bytes, and of the SHA-1 digest */
+#define KEY_LENGTH		24
+#define SHA1_LENGTH		20
 
 void
 nullHandshake(struct handshake *hs)
 {
-	hs->host = NULL;
-	hs->origin = NULL;
-	hs->resource = NULL;
-	hs->key = NULL;
+	memset(&hs->host, 0, sizeof(hs->host));
+	memset(&hs->origin, 0, sizeof(hs->origin));
+	memset(&hs->key, 0, sizeof(hs->key));
+	memset(&hs->resource, 0, sizeof(hs->resource));
+	memset(&hs->extensions, 0, sizeof(hs->extensions));
+	memset(&hs->deflate, 0, sizeof(hs->deflate));
+	hs->deflateAnnounce = 0;
 	hs->frameType = WS_EMPTY_FRAME;
+	hs->scanned = 0;
 }
 
 void
 freeHandshake(struct handshake *hs)
 {
-	free(hs->host);
-	free(hs->origin);
-	free(hs->resource);
-	free(hs->key);
 	nullHandshake(hs);
 }
 
-static char *
-getUptoLinefeed(const char *startFrom)
+/* Case insensitive match of a header field name */
+static int
+isField(const char *name, size_t len, const char *field)
 {
-	char *writeTo = NULL;
-	uint8_t newLength = strstr(startFrom, "\r\n") - startFrom;
+	return !strncasecmp(name, field, len);
+}
 
-	assert(newLength);
-	writeTo = (char *)malloc(newLength + 1);
-	assert(writeTo);
-	memcpy(writeTo, startFrom, newLength);
-	writeTo[newLength] = 0;
+/* Check if a comma separated list of tokens contains a token */
+static int
+hasToken(const char *value, size_t len, const char *token)
+{
+	const char *end = value + len;
+	size_t toklen = strlen(token), n;
 
-	return writeTo;
+	while (value < end) {
+		while (value < end && (*value == ' ' || *value == '\t' ||
+		    *value == ','))
+			value++;
+		for (n = 0; value + n < end && value[n] != ','; n++)
+			;
+		len = n;
+		while (len > 0 && (value[len - 1] == ' ' ||
+		    value[len - 1] == '\t'))
+			len--;
+		if (len == toklen && !strncasecmp(value, token, len))
+			return 1;
+		value += n;
+	}
+	return 0;
 }
 
+/*
+ * Parse the opening handshake in a single pass over the request.  The
+ * strings in the handshake point into inputFrame and remain valid as long as
+ * it does, nothing is allocated.  Header fields are told apart by the length
+ * of their name before the name is compared.  WS_INCOMPLETE_FRAME is
+ * returned if the request does not end with an empty line.
+ */
 enum wsFrameType
 wsParseHandshake(const uint8_t *inputFrame, size_t inputLength,
     struct handshake *hs)
 {
-	const char *inputPtr = (const char *)inputFrame;
-	const char *endPtr = (const char *)inputFrame + inputLength;
+	const char *p = (const char *)inputFrame;
+	const char *end = p + inputLength;
+	const char *eol, *colon, *name, *value;
+	size_t namelen, len;
 	int connectionFlag = 0;
 	int upgradeFlag = 0;
 	int subprotocolFlag = 0;
 	int versionMismatch = 0;
 
-	if (!strstr((const char *)inputFrame, "\r\n\r\n"))
+	nullHandshake(hs);
+
+	/* Request line, "GET <resource> HTTP/1.1" */
+	if ((eol = memchr(p, '\n', end - p)) == NULL)
 		return WS_INCOMPLETE_FRAME;
+	if (eol - p < 4 || memcmp(p, "GET ", 4) != 0 || eol[-1] != '\r')
+		return hs->frameType = WS_ERROR_FRAME;
+	p += 4;
+	if ((value = memchr(p, ' ', eol - p)) == NULL || value == p)
+		return hs->frameType = WS_ERROR_FRAME;
+	hs->resource.s = p;
+	hs->resource.len = value - p;
+	value++;
+	if (eol - 1 - value < 8 || memcmp(value, "HTTP/1.", 7) != 0)
+		return hs->frameType = WS_ERROR_FRAME;
+	p = eol + 1;
 
-	if (memcmp(inputFrame, "GET ", 4) != 0)
-		return WS_ERROR_FRAME;
-
-	/* measure resource size */
-	char *first = strchr((const char *)inputFrame, ' ');
-	if (!first)
-		return WS_ERROR_FRAME;
-	first++;
-	char *second = strchr(first, ' ');
-	if (!second)
-		return WS_ERROR_FRAME;
-
-	if (hs->resource) {
-		free(hs->resource);
-		hs->resource = NULL;
-	}
-	hs->resource = (char *)malloc(second - first + 1);
-	assert(hs->resource);
-
-	if (sscanf(inputPtr, "GET %s HTTP/1.1\r\n", hs->resource) != 1)
-		return WS_ERROR_FRAME;
-	inputPtr = strstr(inputPtr, "\r\n") + 2;
-
-	/* parse next lines */
-	while (inputPtr < endPtr && inputPtr[0] != '\r'
-	    && inputPtr[1] != '\n') {
-		if (!strncasecmp(inputPtr, hostField, strlen(hostField))) {
-			inputPtr += strlen(hostField);
-			free(hs->host);
-			hs->host = getUptoLinefeed(inputPtr);
-		} else if (!strncasecmp(inputPtr, originField,
-		    strlen(originField))) {
-			inputPtr += strlen(originField);
-			free(hs->origin);
-			hs->origin = getUptoLinefeed(inputPtr);
-		} else if (!strncasecmp(inputPtr, protocolField,
-		    strlen(protocolField))) {
-			inputPtr += strlen(protocolField);
-			subprotocolFlag = 1;
-		} else if (!strncasecmp(inputPtr, keyField, strlen(keyField))) {
-			inputPtr += strlen(keyField);
-			free(hs->key);
-			hs->key = getUptoLinefeed(inputPtr);
-		} else if (!strncasecmp(inputPtr, versionField,
-		    strlen(versionField))) {
-			char *versionString;
-
-			inputPtr += strlen(versionField);
-			versionString = getUptoLinefeed(inputPtr);
-			if (memcmp(versionString, version, strlen(version)))
-				versionMismatch = 1;
-			free(versionString);
-		} else if (!strncasecmp(inputPtr, connectionField,
-		    strlen(connectionField))) {
-			char *connectionValue;
-
-			inputPtr += strlen(connectionField);
-			connectionValue = getUptoLinefeed(inputPtr);
-			assert(connectionValue);
-			if (strcasestr(connectionValue, upgrade) != NULL)
-				connectionFlag = 1;
-			free(connectionValue);
-		} else if (!strncasecmp(inputPtr, upgradeField,
-		    strlen(upgradeField))) {
-			char *compare;
-
-			inputPtr += strlen(upgradeField);
-			compare = getUptoLinefeed(inputPtr);
-			assert(compare);
-			if (!strncasecmp(compare, websocket, strlen(websocket)))
+	/* Header fields up to the empty line */
+	for (;;) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			return hs->frameType = WS_INCOMPLETE_FRAME;
+		if (eol == p || eol[-1] != '\r')
+			return hs->frameType = WS_ERROR_FRAME;
+		if (eol - 1 == p)
+			break;
+
+		if ((colon = memchr(p, ':', eol - 1 - p)) == NULL)
+			return hs->frameType = WS_ERROR_FRAME;
+		name = p;
+		namelen = colon - p;
+		value = colon + 1;
+		while (value < eol - 1 && (*value == ' ' || *value == '\t'))
+			value++;
+		len = eol - 1 - value;
+		while (len > 0 && (value[len - 1] == ' ' ||
+		    value[len - 1] == '\t'))
+			len--;
+		p = eol + 1;
+
+		switch (namelen) {
+		case 4:
+			if (isField(name, namelen, "Host")) {
+				hs->host.s = value;
+				hs->host.len = len;
+			}
+			break;
+		case 6:
+			if (isField(name, namelen, "Origin")) {
+				hs->origin.s = value;
+				hs->origin.len = len;
+			}
+			break;
+		case 7:
+			if (isField(name, namelen, "Upgrade") &&
+			    hasToken(value, len, websocket))
 				upgradeFlag = 1;
-			free(compare);
+			break;
+		case 10:
+			if (isField(name, namelen, "Connection") &&
+			    hasToken(value, len, upgrade))
+				connectionFlag = 1;
+			break;
+		case 17:
+			if (isField(name, namelen, "Sec-WebSocket-Key")) {
+				hs->key.s = value;
+				hs->key.len = len;
+			}
+			break;
+		case 21:
+			if (isField(name, namelen, "Sec-WebSocket-Version") &&
+			    (len != strlen(version) ||
+			    memcmp(value, version, len)))
+				versionMismatch = 1;
+			break;
+		case 22:
+			if (isField(name, namelen, "Sec-WebSocket-Protocol"))
+				subprotocolFlag = 1;
+			break;
+		case 24:
+			/* Further lines of the field are ignored */
+			if (isField(name, namelen, "Sec-WebSocket-Extensions")
+			    && hs->extensions.s == NULL) {
+				hs->extensions.s = value;
+				hs->extensions.len = len;
+			}
+			break;
 		}
-		inputPtr = strstr(inputPtr, "\r\n") + 2;
 	}
 
-	/* we have read all data, so check them */
-	if (!hs->host || !hs->key || !connectionFlag || !upgradeFlag ||
-	    subprotocolFlag || versionMismatch)
+	/*
+	 * We have read all data, so check them.  The key is the base64
+	 * encoding of 16 bytes.
+	 */
+	if (hs->host.s == NULL || hs->key.len != KEY_LENGTH || !connectionFlag ||
+	    !upgradeFlag || subprotocolFlag || versionMismatch)
 		hs->frameType = WS_ERROR_FRAME;
 	else
 		hs->frameType = WS_OPENING_FRAME;
@@ -174,46 +231,238 @@ wsParseHandshake(const uint8_t *inputFrame, size_t inputLength,
 	return hs->frameType;
 }
 
+/* Window sizes of permessage-deflate that are announced in the answer */
+#define ANNOUNCE_SERVER_BITS	0x01
+#define ANNOUNCE_CLIENT_BITS	0x02
+
+void
+wsDefaultDeflate(struct wsDeflateParams *params)
+{
+	params->enabled = 1;
+	params->level = Z_DEFAULT_COMPRESSION;
+	params->memLevel = 8;
+	params->serverMaxWindowBits = 15;
+	params->clientMaxWindowBits = 15;
+	params->serverNoContextTakeover = 0;
+	params->clientNoContextTakeover = 0;
+	params->threshold = 64;
+}
+
+static const char *
+skipSpace(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+/*
+ * Get the next token or quoted string of the extensions field and return a
+ * pointer to the delimiter that follows it.
+ */
+static const char *
+nextToken(const char *p, const char *end, struct wsString *tok)
+{
+	p = skipSpace(p, end);
+	if (p < end && *p == '"') {
+		tok->s = ++p;
+		while (p < end && *p != '"')
+			p++;
+		tok->len = p - tok->s;
+		if (p < end)
+			p++;
+	} else {
+		tok->s = p;
+		while (p < end && *p != ',' && *p != ';' && *p != '=' &&
+		    *p != ' ' && *p != '\t')
+			p++;
+		tok->len = p - tok->s;
+	}
+	return skipSpace(p, end);
+}
+
+static int
+isToken(const struct wsString *tok, const char *s)
+{
+	return tok->len == strlen(s) && !strncasecmp(tok->s, s, tok->len);
+}
+
+/* Parse a window size, returns -1 if it is not valid */
+static int
+windowBits(const struct wsString *value)
+{
+	if (value->len == 1 && value->s[0] >= '8' && value->s[0] <= '9')
+		return value->s[0] - '0';
+	if (value->len == 2 && value->s[0] == '1' && value->s[1] >= '0' &&
+	    value->s[1] <= '5')
+		return 10 + value->s[1] - '0';
+	return -1;
+}
+
+/*
+ * Negotiate permessage-deflate with the offers in the extensions field of
+ * the request.  The first offer that can be accepted with the configured
+ * parameters is accepted and the resulting parameters are stored in the
+ * handshake, to be announced by wsGetHandshakeAnswer().  Returns 1 if an
+ * offer was accepted.
+ */
+int
+wsNegotiateDeflate(struct handshake *hs, const struct wsDeflateParams *config)
+{
+	const char *p, *end;
+	struct wsString name, param, value;
+	struct wsDeflateParams res;
+	int bits, ok, seen;
+
+	hs->deflate.enabled = 0;
+	hs->deflateAnnounce = 0;
+	if (!config->enabled || hs->extensions.s == NULL)
+		return 0;
+
+	p = hs->extensions.s;
+	end = p + hs->extensions.len;
+	while (p < end) {
+		p = nextToken(p, end, &name);
+		res = *config;
+		ok = 1;
+		seen = 0;
+		while (p < end && *p == ';') {
+			p = nextToken(p + 1, end, &param);
+			value.s = NULL;
+			value.len = 0;
+			if (p < end && *p == '=')
+				p = nextToken(p + 1, end, &value);
+
+			/* Parameters must not be repeated */
+			if (isToken(&param, "server_no_context_takeover") &&
+			    value.s == NULL && !(seen & 0x01)) {
+				seen |= 0x01;
+				res.serverNoContextTakeover = 1;
+			} else if (isToken(&param,
+			    "client_no_context_takeover") && value.s == NULL &&
+			    !(seen & 0x02)) {
+				seen |= 0x02;
+			} else if (isToken(&param, "server_max_window_bits") &&
+			    !(seen & 0x04)) {
+				seen |= 0x04;
+				/* zlib can not compress with a 256 byte window */
+				if ((bits = windowBits(&value)) < 9)
+					ok = 0;
+				else if (bits < res.serverMaxWindowBits)
+					res.serverMaxWindowBits = bits;
+			} else if (isToken(&param, "client_max_window_bits") &&
+			    !(seen & 0x08)) {
+				seen |= 0x08;
+				if (value.s == NULL)
+					continue;
+				if ((bits = windowBits(&value)) < 0)
+					ok = 0;
+				else if (bits < res.clientMaxWindowBits)
+					res.clientMaxWindowBits = bits;
+			} else
+				ok = 0;
+		}
+
+		/* Skip anything malformed up to the next offer */
+		while (p < end && *p != ',')
+			p++;
+		if (p < end)
+			p++;
+
+		if (!ok || !isToken(&name, "permessage-deflate"))
+			continue;
+
+		/* The window of a client that can't be limited is 32K */
+		if (!(seen & 0x08))
+			res.clientMaxWindowBits = 15;
+		if (seen & 0x04)
+			hs->deflateAnnounce |= ANNOUNCE_SERVER_BITS;
+		if ((seen & 0x08) && res.clientMaxWindowBits < 15)
+			hs->deflateAnnounce |= ANNOUNCE_CLIENT_BITS;
+		hs->deflate = res;
+		hs->deflate.enabled = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* The answer to a valid handshake, only the accept key varies */
+static const char acceptResponse[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: ";
+static const char acceptEnd[] = "\r\n\r\n";
+
+/*
+ * With OpenSSL 3 each use of EVP_sha1() fetches the implementation again,
+ * which costs more than hashing the key.  Fetch it once.
+ */
+static const EVP_MD *
+sha1(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static EVP_MD *md;
+	EVP_MD *fetched, *expected = NULL;
+
+	if ((fetched = __atomic_load_n(&md, __ATOMIC_ACQUIRE)) != NULL)
+		return fetched;
+	if ((fetched = EVP_MD_fetch(NULL, "SHA1", NULL)) == NULL)
+		return EVP_sha1();
+	if (!__atomic_compare_exchange_n(&md, &expected, fetched, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		EVP_MD_free(fetched);
+		return expected;
+	}
+	return fetched;
+#else
+	return EVP_sha1();
+#endif
+}
+
 void
 wsGetHandshakeAnswer(const struct handshake *hs, uint8_t *outFrame,
     size_t *outLength)
 {
-	BIO *bio, *md;
-	char *responseKey, *b64;
-	unsigned char mdbuf[EVP_MAX_MD_SIZE];
-	int mdlen;
+	uint8_t responseKey[KEY_LENGTH + sizeof(secret) - 1];
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+	size_t written;
 
-	assert(outFrame && *outLength);
+	assert(hs && hs->key.s);
 	assert(hs->frameType == WS_OPENING_FRAME);
-	assert(hs && hs->key);
-
-	uint8_t length = strlen(hs->key) + strlen(secret);
-	responseKey = malloc(length + 1);
-	memcpy(responseKey, hs->key, strlen(hs->key));
-	memcpy(&(responseKey[strlen(hs->key)]), secret, strlen(secret));
-	responseKey[length] = '\0';
-
-	/* Setup the message digest BIO chain */
-	bio = BIO_new(BIO_s_null());
-	md = BIO_new(BIO_f_md());
-	BIO_set_md(md, EVP_sha1());
-	bio = BIO_push(md, bio);
-	BIO_printf(md, "%s", responseKey);
-
-	mdlen = BIO_gets(md, (char *)mdbuf, EVP_MAX_MD_SIZE);
- 	b64 = base64(mdbuf, mdlen);
-	BIO_free(bio);
-
-	size_t written = sprintf((char *)outFrame,
-	    "HTTP/1.1 101 Switching Protocols\r\n"
-	    "%s%s\r\n"
-	    "%s%s\r\n"
-	    "Sec-WebSocket-Accept: %s\r\n\r\n", upgradeField,
-	     websocket, connectionField, upgrade2, b64);
-	free(b64);
+	assert(hs->key.len == KEY_LENGTH);
 
 	/* if the assert fails, that means, that we corrupt memory */
-	assert(written <= *outLength);
+	assert(*outLength >= WS_MAX_ANSWER);
+
+	memcpy(responseKey, hs->key.s, KEY_LENGTH);
+	memcpy(responseKey + KEY_LENGTH, secret, sizeof(secret) - 1);
+	EVP_Digest(responseKey, sizeof(responseKey), md, &mdlen, sha1(), NULL);
+
+	memcpy(outFrame, acceptResponse, sizeof(acceptResponse) - 1);
+	written = sizeof(acceptResponse) - 1;
+	written += base64_encode((char *)outFrame + written, md, mdlen);
+
+	if (hs->deflate.enabled)
+		written += snprintf((char *)outFrame + written,
+		    *outLength - written,
+		    "\r\nSec-WebSocket-Extensions: permessage-deflate%s%s",
+		    hs->deflate.serverNoContextTakeover ?
+		    "; server_no_context_takeover" : "",
+		    hs->deflate.clientNoContextTakeover ?
+		    "; client_no_context_takeover" : "");
+	if (hs->deflateAnnounce & ANNOUNCE_SERVER_BITS)
+		written += snprintf((char *)outFrame + written,
+		    *outLength - written, "; server_max_window_bits=%d",
+		    hs->deflate.serverMaxWindowBits);
+	if (hs->deflateAnnounce & ANNOUNCE_CLIENT_BITS)
+		written += snprintf((char *)outFrame + written,
+		    *outLength - written, "; client_max_window_bits=%d",
+		    hs->deflate.clientMaxWindowBits);
+
+	memcpy(outFrame + written, acceptEnd, sizeof(acceptEnd) - 1);
+	written += sizeof(acceptEnd) - 1;
 	*outLength = written;
 }
 
@@ -228,35 +477,552 @@ htonll(uint64_t value)
 	return (uint64_t)low << 32 | high;
 }
 
-void
-wsMakeFrame(const uint8_t *data, size_t dataLength, uint8_t *outFrame,
-    size_t *outLength, enum wsFrameType frameType)
+/*
+ * Build the header of an unmasked (server to client) frame, outFrame must
+ * have room for WS_MAX_HEADER bytes.  Returns the length of the header.
+ */
+size_t
+wsMakeFrameHeader(size_t dataLength, uint8_t *outFrame,
+    enum wsFrameType frameType)
 {
-	assert(outFrame && outLength);
+	assert(outFrame);
 	assert(frameType < 0x10);
-	if (dataLength > 0)
-		assert(data);
 
 	outFrame[0] = 0x80 | frameType;
 
 	if (dataLength <= 125) {
 		outFrame[1] = dataLength;
-		*outLength = 2;
+		return 2;
 	} else if (dataLength <= 0xFFFF) {
 		outFrame[1] = 126;
 		uint16_t payloadLength16b = htons(dataLength);
 		memcpy(&outFrame[2], &payloadLength16b, 2);
-		*outLength = 4;
+		return 4;
 	} else {
 		outFrame[1] = 127;
 		uint64_t payloadLength64b = htonll((uint64_t)dataLength);
 		memcpy(&outFrame[2], &payloadLength64b, 8);
-		*outLength = 10;
+		return 10;
 	}
+}
+
+void
+wsMakeFrame(const uint8_t *data, size_t dataLength, uint8_t *outFrame,
+    size_t *outLength, enum wsFrameType frameType)
+{
+	assert(outFrame && outLength);
+	if (dataLength > 0)
+		assert(data);
+
+	*outLength = wsMakeFrameHeader(dataLength, outFrame, frameType);
 	memcpy(&outFrame[*outLength], data, dataLength);
 	*outLength += dataLength;
 }
 
+/*
+ * Unmasking kernels.  They are called with a pointer aligned to UNMASK_ALIGN
+ * and an eight byte masking pattern that has already been rotated to match
+ * that alignment, so the 32 bit key can be applied as a 64 bit (or vector)
+ * word.
+ */
+static void
+unmaskWord(uint8_t *data, size_t len, const uint8_t *pattern)
+{
+	uint64_t mask, w0, w1, w2, w3;
+	size_t i;
+
+	memcpy(&mask, pattern, sizeof(mask));
+	for (i = 0; i + 32 <= len; i += 32) {
+		memcpy(&w0, data + i, 8);
+		memcpy(&w1, data + i + 8, 8);
+		memcpy(&w2, data + i + 16, 8);
+		memcpy(&w3, data + i + 24, 8);
+		w0 ^= mask;
+		w1 ^= mask;
+		w2 ^= mask;
+		w3 ^= mask;
+		memcpy(data + i, &w0, 8);
+		memcpy(data + i + 8, &w1, 8);
+		memcpy(data + i + 16, &w2, 8);
+		memcpy(data + i + 24, &w3, 8);
+	}
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w0, data + i, 8);
+		w0 ^= mask;
+		memcpy(data + i, &w0, 8);
+	}
+	for (; i < len; i++)
+		data[i] ^= pattern[i & 3];
+}
+
+#ifdef WS_HAVE_X86_SIMD
+__attribute__((target("sse2"))) static void
+unmaskSSE2(uint8_t *data, size_t len, const uint8_t *pattern)
+{
+	__m128i mask, *p;
+	size_t i;
+
+	mask = _mm_loadl_epi64((const __m128i *)pattern);
+	mask = _mm_unpacklo_epi64(mask, mask);
+	for (i = 0; i + 64 <= len; i += 64) {
+		p = (__m128i *)(data + i);
+		_mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), mask));
+		_mm_store_si128(p + 1, _mm_xor_si128(_mm_load_si128(p + 1),
+		    mask));
+		_mm_store_si128(p + 2, _mm_xor_si128(_mm_load_si128(p + 2),
+		    mask));
+		_mm_store_si128(p + 3, _mm_xor_si128(_mm_load_si128(p + 3),
+		    mask));
+	}
+	for (; i + 16 <= len; i += 16) {
+		p = (__m128i *)(data + i);
+		_mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), mask));
+	}
+	unmaskWord(data + i, len - i, pattern);
+}
+
+__attribute__((target("avx2"))) static void
+unmaskAVX2(uint8_t *data, size_t len, const uint8_t *pattern)
+{
+	__m256i mask, *p;
+	size_t i;
+
+	mask = _mm256_broadcastsi128_si256(_mm_unpacklo_epi64(
+	    _mm_loadl_epi64((const __m128i *)pattern),
+	    _mm_loadl_epi64((const __m128i *)pattern)));
+	for (i = 0; i + 128 <= len; i += 128) {
+		p = (__m256i *)(data + i);
+		_mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p),
+		    mask));
+		_mm256_store_si256(p + 1, _mm256_xor_si256(
+		    _mm256_load_si256(p + 1), mask));
+		_mm256_store_si256(p + 2, _mm256_xor_si256(
+		    _mm256_load_si256(p + 2), mask));
+		_mm256_store_si256(p + 3, _mm256_xor_si256(
+		    _mm256_load_si256(p + 3), mask));
+	}
+	for (; i + 32 <= len; i += 32) {
+		p = (__m256i *)(data + i);
+		_mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p),
+		    mask));
+	}
+	/* The compiler does not clear the upper halves before a tail call */
+	_mm256_zeroupper();
+	unmaskWord(data + i, len - i, pattern);
+}
+#endif
+
+/*
+ * UTF-8 validation, RFC 3629.  The scalar validator is a state machine
+ * whose state is the number of continuation bytes still expected and the
+ * range the next one must be in, which excludes overlong forms, surrogates
+ * and code points above U+10FFFF.  The state is kept between the fragments
+ * of a message.
+ */
+#define UTF8_STATE(n, lo, hi)	((n) << 16 | (lo) << 8 | (hi))
+
+static uint32_t
+utf8Step(uint32_t state, uint8_t c)
+{
+	if (state == WS_UTF8_ACCEPT) {
+		if (c < 0x80)
+			return WS_UTF8_ACCEPT;
+		if (c < 0xc2 || c > 0xf4)
+			return WS_UTF8_REJECT;
+		if (c < 0xe0)
+			return UTF8_STATE(1, 0x80, 0xbf);
+		if (c == 0xe0)
+			return UTF8_STATE(2, 0xa0, 0xbf);
+		if (c == 0xed)
+			return UTF8_STATE(2, 0x80, 0x9f);
+		if (c < 0xf0)
+			return UTF8_STATE(2, 0x80, 0xbf);
+		if (c == 0xf0)
+			return UTF8_STATE(3, 0x90, 0xbf);
+		if (c == 0xf4)
+			return UTF8_STATE(3, 0x80, 0x8f);
+		return UTF8_STATE(3, 0x80, 0xbf);
+	}
+	if (state == WS_UTF8_REJECT || c < ((state >> 8) & 0xff) ||
+	    c > (state & 0xff))
+		return WS_UTF8_REJECT;
+	return (state >> 16) == 1 ? WS_UTF8_ACCEPT :
+	    UTF8_STATE((state >> 16) - 1, 0x80, 0xbf);
+}
+
+static uint32_t
+utf8Scalar(uint32_t state, const uint8_t *data, size_t len)
+{
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i < len && state != WS_UTF8_REJECT; ) {
+		/* Skip ASCII a word at a time */
+		if (state == WS_UTF8_ACCEPT && i + 8 <= len) {
+			memcpy(&w, data + i, sizeof(w));
+			if ((w & 0x8080808080808080ULL) == 0) {
+				i += 8;
+				continue;
+			}
+		}
+		state = utf8Step(state, data[i++]);
+	}
+	return state;
+}
+
+/*
+ * Unmask and validate kernels, called like the unmasking kernels but at a
+ * character boundary.  Unmasked blocks are validated while they are still
+ * in registers, so each byte is loaded and stored once.
+ */
+static uint32_t
+utf8Word(uint8_t *data, size_t len, const uint8_t *pattern, uint32_t state)
+{
+	size_t i, n;
+
+	for (i = 0; i < len && state != WS_UTF8_REJECT; i += n) {
+		n = len - i < 256 ? len - i : 256;
+		unmaskWord(data + i, n, pattern);
+		state = utf8Scalar(state, data + i, n);
+	}
+	return state;
+}
+
+/*
+ * The state after the vector blocks ending at data + len.  They have been
+ * checked, except whether the last character is complete: it is passed
+ * through the state machine again.
+ */
+static uint32_t
+utf8Tail(const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 1; i <= 3 && i <= len; i++) {
+		if ((data[len - i] & 0xc0) == 0x80)
+			continue;
+		return data[len - i] < 0x80 ? WS_UTF8_ACCEPT :
+		    utf8Scalar(WS_UTF8_ACCEPT, data + len - i, i);
+	}
+	return WS_UTF8_ACCEPT;
+}
+
+#ifdef WS_HAVE_X86_SIMD
+/*
+ * Vector validation after Keiser and Lemire, "Validating UTF-8 in less
+ * than one instruction per byte".  Three table lookups on the nibbles of
+ * each byte and the byte before it flag the errors of two byte sequences,
+ * the lengths of longer sequences are checked against the bytes two and
+ * three positions back.
+ */
+#define UTF8_TOO_SHORT		(1 << 0)
+#define UTF8_TOO_LONG		(1 << 1)
+#define UTF8_OVERLONG_3		(1 << 2)
+#define UTF8_TOO_LARGE		(1 << 3)
+#define UTF8_SURROGATE		(1 << 4)
+#define UTF8_OVERLONG_2		(1 << 5)
+#define UTF8_TOO_LARGE_1000	(1 << 6)
+#define UTF8_OVERLONG_4		(1 << 6)
+#define UTF8_TWO_CONTS		(1 << 7)
+#define UTF8_CARRY		(UTF8_TOO_SHORT | UTF8_TOO_LONG | \
+				    UTF8_TWO_CONTS)
+
+static const int8_t utf8Byte1High[16] = {
+	/* 0_______ ASCII */
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	/* 10______ continuation */
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	/* 1100____, 1101____ two byte lead */
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	UTF8_TOO_SHORT,
+	/* 1110____ three byte lead */
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	/* 1111____ four byte lead */
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+	    UTF8_OVERLONG_4
+};
+
+static const int8_t utf8Byte1Low[16] = {
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	UTF8_CARRY | UTF8_OVERLONG_2,
+	UTF8_CARRY,
+	UTF8_CARRY,
+	UTF8_CARRY | UTF8_TOO_LARGE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+static const int8_t utf8Byte2High[16] = {
+	/* ________ 0_______ ASCII */
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	/* ________ 1000____ */
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+	    UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	/* ________ 1001____ */
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+	    UTF8_TOO_LARGE,
+	/* ________ 101_____ */
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+	    UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+	    UTF8_TOO_LARGE,
+	/* ________ 11______ lead */
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+__attribute__((target("sse4.1"))) static __m128i
+utf8CheckSSE41(__m128i input, __m128i prev, __m128i t1h, __m128i t1l,
+    __m128i t2h)
+{
+	__m128i nibble, prev1, prev2, prev3, sc, must23;
+
+	nibble = _mm_set1_epi8(0x0f);
+	prev1 = _mm_alignr_epi8(input, prev, 15);
+	sc = _mm_and_si128(_mm_and_si128(
+	    _mm_shuffle_epi8(t1h, _mm_and_si128(_mm_srli_epi16(prev1, 4),
+	    nibble)),
+	    _mm_shuffle_epi8(t1l, _mm_and_si128(prev1, nibble))),
+	    _mm_shuffle_epi8(t2h, _mm_and_si128(_mm_srli_epi16(input, 4),
+	    nibble)));
+
+	/* Third and fourth bytes must be continuations, and only those */
+	prev2 = _mm_alignr_epi8(input, prev, 14);
+	prev3 = _mm_alignr_epi8(input, prev, 13);
+	must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0x60)),
+	    _mm_subs_epu8(prev3, _mm_set1_epi8(0x70)));
+	return _mm_xor_si128(_mm_and_si128(must23,
+	    _mm_set1_epi8((char)0x80)), sc);
+}
+
+/* Nonzero where a character starts in the last bytes and is incomplete */
+static const uint8_t utf8Incomplete[32] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+};
+
+/*
+ * The vector kernels do not depend on alignment.  Blocks of ASCII are not
+ * looked up, they only must not follow an incomplete character.
+ */
+__attribute__((target("sse4.1"))) static uint32_t
+utf8SSE41(uint8_t *data, size_t len, const uint8_t *pattern, uint32_t state)
+{
+	__m128i mask, in0, in1, prev, error, incomplete, max;
+	__m128i t1h, t1l, t2h, *p;
+	size_t i;
+
+	mask = _mm_loadl_epi64((const __m128i *)pattern);
+	mask = _mm_unpacklo_epi64(mask, mask);
+	t1h = _mm_loadu_si128((const __m128i *)utf8Byte1High);
+	t1l = _mm_loadu_si128((const __m128i *)utf8Byte1Low);
+	t2h = _mm_loadu_si128((const __m128i *)utf8Byte2High);
+	max = _mm_loadu_si128((const __m128i *)(utf8Incomplete + 16));
+	prev = error = incomplete = _mm_setzero_si128();
+	for (i = 0; i + 32 <= len; i += 32) {
+		p = (__m128i *)(data + i);
+		in0 = _mm_xor_si128(_mm_loadu_si128(p), mask);
+		in1 = _mm_xor_si128(_mm_loadu_si128(p + 1), mask);
+		_mm_storeu_si128(p, in0);
+		_mm_storeu_si128(p + 1, in1);
+		if (_mm_movemask_epi8(_mm_or_si128(in0, in1)) == 0)
+			error = _mm_or_si128(error, incomplete);
+		else {
+			error = _mm_or_si128(error, utf8CheckSSE41(in0, prev,
+			    t1h, t1l, t2h));
+			error = _mm_or_si128(error, utf8CheckSSE41(in1, in0,
+			    t1h, t1l, t2h));
+			incomplete = _mm_subs_epu8(in1, max);
+		}
+		prev = in1;
+	}
+	for (; i + 16 <= len; i += 16) {
+		p = (__m128i *)(data + i);
+		in0 = _mm_xor_si128(_mm_loadu_si128(p), mask);
+		_mm_storeu_si128(p, in0);
+		error = _mm_or_si128(error, utf8CheckSSE41(in0, prev, t1h,
+		    t1l, t2h));
+		prev = in0;
+	}
+	if (!_mm_testz_si128(error, error))
+		return WS_UTF8_REJECT;
+	state = utf8Tail(data, i);
+	return i < len ? utf8Word(data + i, len - i, pattern, state) : state;
+}
+
+__attribute__((target("avx2"))) static __m256i
+utf8CheckAVX2(__m256i input, __m256i prev, __m256i t1h, __m256i t1l,
+    __m256i t2h)
+{
+	__m256i nibble, shifted, prev1, prev2, prev3, sc, must23;
+
+	/* The bytes before those of input, across the lanes */
+	nibble = _mm256_set1_epi8(0x0f);
+	shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+	prev1 = _mm256_alignr_epi8(input, shifted, 15);
+	sc = _mm256_and_si256(_mm256_and_si256(
+	    _mm256_shuffle_epi8(t1h, _mm256_and_si256(
+	    _mm256_srli_epi16(prev1, 4), nibble)),
+	    _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, nibble))),
+	    _mm256_shuffle_epi8(t2h, _mm256_and_si256(
+	    _mm256_srli_epi16(input, 4), nibble)));
+
+	prev2 = _mm256_alignr_epi8(input, shifted, 14);
+	prev3 = _mm256_alignr_epi8(input, shifted, 13);
+	must23 = _mm256_or_si256(
+	    _mm256_subs_epu8(prev2, _mm256_set1_epi8(0x60)),
+	    _mm256_subs_epu8(prev3, _mm256_set1_epi8(0x70)));
+	return _mm256_xor_si256(_mm256_and_si256(must23,
+	    _mm256_set1_epi8((char)0x80)), sc);
+}
+
+__attribute__((target("avx2"))) static uint32_t
+utf8AVX2(uint8_t *data, size_t len, const uint8_t *pattern, uint32_t state)
+{
+	__m256i mask, in0, in1, prev, error, incomplete, max;
+	__m256i t1h, t1l, t2h, *p;
+	size_t i;
+
+	mask = _mm256_broadcastsi128_si256(_mm_unpacklo_epi64(
+	    _mm_loadl_epi64((const __m128i *)pattern),
+	    _mm_loadl_epi64((const __m128i *)pattern)));
+	t1h = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)utf8Byte1High));
+	t1l = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)utf8Byte1Low));
+	t2h = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)utf8Byte2High));
+	max = _mm256_loadu_si256((const __m256i *)utf8Incomplete);
+	prev = error = incomplete = _mm256_setzero_si256();
+	for (i = 0; i + 64 <= len; i += 64) {
+		p = (__m256i *)(data + i);
+		in0 = _mm256_xor_si256(_mm256_loadu_si256(p), mask);
+		in1 = _mm256_xor_si256(_mm256_loadu_si256(p + 1), mask);
+		_mm256_storeu_si256(p, in0);
+		_mm256_storeu_si256(p + 1, in1);
+		if (_mm256_movemask_epi8(_mm256_or_si256(in0, in1)) == 0)
+			error = _mm256_or_si256(error, incomplete);
+		else {
+			error = _mm256_or_si256(error, utf8CheckAVX2(in0, prev,
+			    t1h, t1l, t2h));
+			error = _mm256_or_si256(error, utf8CheckAVX2(in1, in0,
+			    t1h, t1l, t2h));
+			incomplete = _mm256_subs_epu8(in1, max);
+		}
+		prev = in1;
+	}
+	for (; i + 32 <= len; i += 32) {
+		p = (__m256i *)(data + i);
+		in0 = _mm256_xor_si256(_mm256_loadu_si256(p), mask);
+		_mm256_storeu_si256(p, in0);
+		error = _mm256_or_si256(error, utf8CheckAVX2(in0, prev, t1h,
+		    t1l, t2h));
+		prev = in0;
+	}
+	if (!_mm256_testz_si256(error, error))
+		return WS_UTF8_REJECT;
+	_mm256_zeroupper();
+	state = utf8Tail(data, i);
+	return i < len ? utf8Word(data + i, len - i, pattern, state) : state;
+}
+#endif
+
+static void (*unmaskKernel)(uint8_t *, size_t, const uint8_t *);
+static uint32_t (*utf8Kernel)(uint8_t *, size_t, const uint8_t *, uint32_t);
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+/* Readers run in several threads, each pointer is only assigned once */
+static void
+selectUnmaskKernel(void)
+{
+	void (*unmask)(uint8_t *, size_t, const uint8_t *);
+	uint32_t (*utf8)(uint8_t *, size_t, const uint8_t *, uint32_t);
+
+	unmask = unmaskWord;
+	utf8 = utf8Word;
+#ifdef WS_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		unmask = unmaskAVX2;
+		utf8 = utf8AVX2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		unmask = unmaskSSE2;
+		if (__builtin_cpu_supports("sse4.1"))
+			utf8 = utf8SSE41;
+	}
+#endif
+	unmaskKernel = unmask;
+	utf8Kernel = utf8;
+}
+
+static void
+initKernels(void)
+{
+	pthread_once(&kernelsOnce, selectUnmaskKernel);
+}
+
+void
+wsUnmask(uint8_t *data, size_t len, const uint8_t *maskingKey)
+{
+	uint8_t pattern[8];
+	size_t head, i;
+
+	initKernels();
+
+	/* Unmask byte-wise up to the alignment boundary */
+	head = -(uintptr_t)data & (UNMASK_ALIGN - 1);
+	if (head > len)
+		head = len;
+	for (i = 0; i < head; i++)
+		data[i] ^= maskingKey[i & 3];
+
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = maskingKey[(head + i) & 3];
+	unmaskKernel(data + head, len - head, pattern);
+}
+
+/*
+ * Unmask a fragment of a text message and validate it, starting in state.
+ * Returns the state after the fragment: WS_UTF8_ACCEPT at the end of a
+ * character, WS_UTF8_REJECT on invalid input or the state within a
+ * character that continues in the next fragment.  The kernels start at a
+ * character boundary, so a character continued from the previous fragment
+ * is completed byte-wise.
+ */
+uint32_t
+wsUnmaskUTF8(uint8_t *data, size_t len, const uint8_t *maskingKey,
+    uint32_t state)
+{
+	uint8_t pattern[8];
+	size_t head, i;
+
+	initKernels();
+
+	for (i = 0; i < len && state != WS_UTF8_ACCEPT; i++) {
+		data[i] ^= maskingKey[i & 3];
+		if ((state = utf8Step(state, data[i])) == WS_UTF8_REJECT)
+			return state;
+	}
+	if (i == len)
+		return state;
+
+	for (head = i, i = 0; i < sizeof(pattern); i++)
+		pattern[i] = maskingKey[(head + i) & 3];
+	return utf8Kernel(data + head, len - head, pattern, state);
+}
+
 size_t
 wsGetPayloadLength(const uint8_t *inputFrame, size_t inputLength,
     uint8_t *payloadFieldExtraBytes, enum wsFrameType *frameType)
@@ -269,34 +1035,46 @@ wsGetPayloadLength(const uint8_t *inputFrame, size_t inputLength,
 		*frameType = WS_INCOMPLETE_FRAME;
 		return 0;
 	}
-	if (payloadLength == 0x7F && (inputFrame[3] & 0x80) != 0x0) {
+	if (payloadLength == 0x7F && (inputFrame[2] & 0x80) != 0x0) {
 		*frameType = WS_ERROR_FRAME;
 		return 0;
 	}
 
 	if (payloadLength == 0x7E) {
-		*payloadFieldExtraBytes = 2;
+		uint16_t payloadLength16b;
 
-		payloadLength = be16toh(*(uint16_t *)&inputFrame[2]);
+		*payloadFieldExtraBytes = 2;
+		memcpy(&payloadLength16b, &inputFrame[2], 2);
+		payloadLength = be16toh(payloadLength16b);
 	} else if (payloadLength == 0x7F) {
-		*payloadFieldExtraBytes = 8;
+		uint64_t payloadLength64b;
 
-		if (payloadLength > SIZE_MAX) {
+		*payloadFieldExtraBytes = 8;
+		memcpy(&payloadLength64b, &inputFrame[2], 8);
+		payloadLength64b = be64toh(payloadLength64b);
+		if (payloadLength64b > SIZE_MAX) {
 			*frameType = WS_ERROR_FRAME;
 			return 0;
 		}
+		payloadLength = payloadLength64b;
 	}
 	return payloadLength;
 }
 
-enum wsFrameType
-wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr,
-    size_t *dataLength)
+/*
+ * Parse and unmask a frame.  If utf8 is not NULL, the payload is validated
+ * as a fragment of a text message while unmasking, starting in the state it
+ * points to, which is updated.
+ */
+static enum wsFrameType
+parseFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr,
+    size_t *dataLength, uint32_t *utf8)
 {
 	assert(inputFrame && inputLength);
 
 	uint8_t opcode = inputFrame[0] & 0x0F;
-	if (opcode == WS_TEXT_FRAME ||
+	if (opcode == WS_CONTINUATION_FRAME ||
+	    opcode == WS_TEXT_FRAME ||
 	    opcode == WS_BINARY_FRAME ||
 	    opcode == WS_CLOSING_FRAME ||
 	    opcode == WS_PING_FRAME ||
@@ -307,7 +1085,6 @@ wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr,
 		size_t payloadLength = wsGetPayloadLength(inputFrame,
 		    inputLength, &payloadFieldExtraBytes, &frameType);
 		if (payloadLength > 0) {
-			size_t i;
 			uint8_t *maskingKey = &inputFrame[2 +
 			     payloadFieldExtraBytes];
 
@@ -317,8 +1094,11 @@ wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr,
 			*dataPtr = &inputFrame[2 + payloadFieldExtraBytes + 4];
 			*dataLength = payloadLength;
 
-			for (i = 0; i < *dataLength; i++)
-				(*dataPtr)[i] = (*dataPtr)[i] ^ maskingKey[i%4];
+			if (utf8 != NULL)
+				*utf8 = wsUnmaskUTF8(*dataPtr, *dataLength,
+				    maskingKey, *utf8);
+			else
+				wsUnmask(*dataPtr, *dataLength, maskingKey);
 		} else {
 			*dataPtr = NULL;
 			*dataLength = 0;
@@ -329,115 +1109,677 @@ wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr,
 }
 
 enum wsFrameType
-wsRead(char **dest, size_t *destlen,
-    int(*readfunc)(void *, unsigned char *, size_t),
-    int(*writefunc)(void *, unsigned char *, size_t), void *client_data)
+wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr,
+    size_t *dataLength)
 {
-	unsigned char *data;
-	char *buf;
-	size_t bufsize, nread, len, datasize;
-	int type;
-	uint8_t payloadFieldExtraBytes = 0;
-	size_t payloadLength;
-	enum wsFrameType frameType;
+	return parseFrame(inputFrame, inputLength, dataPtr, dataLength, NULL);
+}
+
+void
+nullReader(struct wsReader *r)
+{
+	r->buf = NULL;
+	r->bufsize = 0;
+	r->start = r->end = 0;
+	r->msg = NULL;
+	r->msgsize = r->msglen = 0;
+	r->msgtype = WS_EMPTY_FRAME;
+	r->maxMessageSize = WS_MAX_MESSAGE;
+	r->zs = NULL;
+	r->inflateBits = 0;
+	r->inflateNoContextTakeover = 0;
+	r->msgcompressed = 0;
+	r->utf8state = WS_UTF8_ACCEPT;
+}
 
-	bufsize = INITIAL_BUFSIZE;
-	buf = malloc(bufsize);
-	if (buf == NULL)
+void
+freeReader(struct wsReader *r)
+{
+	size_t maxMessageSize = r->maxMessageSize;
+
+	free(r->buf);
+	free(r->msg);
+	if (r->zs != NULL) {
+		inflateEnd(r->zs);
+		free(r->zs);
+	}
+	nullReader(r);
+	r->maxMessageSize = maxMessageSize;
+}
+
+/*
+ * Make room for at least need bytes of unconsumed data in the read-ahead
+ * buffer, moving pending bytes to the front or growing the buffer.
+ */
+static int
+readerReserve(struct wsReader *r, size_t need)
+{
+	size_t pending = r->end - r->start;
+	uint8_t *buf;
+
+	if (need < READAHEAD_SIZE)
+		need = READAHEAD_SIZE;
+	if (r->bufsize - r->start >= need)
+		return 0;
+	if (r->start > 0) {
+		memmove(r->buf, r->buf + r->start, pending);
+		r->start = 0;
+		r->end = pending;
+	}
+	if (r->bufsize < need) {
+		if ((buf = realloc(r->buf, need)) == NULL)
+			return -1;
+		r->buf = buf;
+		r->bufsize = need;
+	}
+	return 0;
+}
+
+/*
+ * Append data that was received by other means than the readfunc, e.g. by
+ * io_uring, to the read-ahead buffer.
+ */
+int
+wsFeed(struct wsReader *r, const uint8_t *data, size_t len)
+{
+	if (readerReserve(r, r->end - r->start + len))
 		return -1;
+	memcpy(r->buf + r->end, data, len);
+	r->end += len;
+	return 0;
+}
 
-	nread = len = 0;
-	type = WS_INCOMPLETE_FRAME;
-	do {
-		/*
-		 * The most common frame header is six bytes long, try to read
-		 * 6 bytes and then determine the actual payload size and read
-		 * the remaining data.
-		 */
-		do {
-			nread = readfunc(client_data, buf, 6);
-			if (nread <= 0) {	/* remote closed */
-				free(buf);
-				return -1;
+/*
+ * Read the opening handshake into the read-ahead buffer of the reader and
+ * parse it once the blank line that ends the request has arrived.  The
+ * request may arrive in any number of pieces.  If readfunc fails with errno
+ * set to EAGAIN, WS_INCOMPLETE_FRAME is returned and the next call continues
+ * where this one left off, searching only the bytes read since.  Bytes that
+ * follow the request, e.g. the first frame of a client that did not wait for
+ * the answer, are left in the reader for wsRead().  The strings of the
+ * handshake point into the read-ahead buffer and are only valid until the
+ * next call to wsRead().
+ */
+enum wsFrameType
+wsReadHandshake(struct wsReader *r, struct handshake *hs,
+    int(*readfunc)(void *, unsigned char *, size_t), void *client_data)
+{
+	uint8_t *request, *eoh;
+	size_t avail, from, reqlen;
+	enum wsFrameType type;
+	int nread;
+
+	for (;;) {
+		avail = r->end - r->start;
+		if (avail >= 4) {
+			request = r->buf + r->start;
+			from = hs->scanned > 3 ? hs->scanned - 3 : 0;
+			eoh = memmem(request + from, avail - from, "\r\n\r\n",
+			    4);
+			if (eoh != NULL) {
+				reqlen = eoh + 4 - request;
+				break;
 			}
-			len += nread;
-		} while (len < 2);	/* 2 is the minimum */
+			hs->scanned = avail;
+		}
+		if (avail >= WS_MAX_HANDSHAKE)
+			return WS_ERROR_FRAME;
 
-		if (((buf[0] & 0x70) != 0x0) || ((buf[0] & 0x80) != 0x80) ||
-		    ((buf[1] & 0x80) != 0x80)) {
-			free(buf);
+		if (readerReserve(r, WS_MAX_HANDSHAKE))
+			return WS_ERROR_FRAME;
+		nread = readfunc(client_data, r->buf + r->end,
+		    r->bufsize - r->end);
+		if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return WS_INCOMPLETE_FRAME;
+		if (nread <= 0)
+			return WS_ERROR_FRAME;
+		r->end += nread;
+	}
+
+	type = wsParseHandshake(request, reqlen, hs);
+	r->start += reqlen;
+	hs->scanned = 0;
+	return type;
+}
+
+/* Make room for len more bytes in the reassembly buffer */
+static int
+readerGrow(struct wsReader *r, size_t len)
+{
+	size_t size;
+	uint8_t *msg;
+
+	if (r->msgsize - r->msglen >= len)
+		return 0;
+	size = r->msgsize ? r->msgsize : READAHEAD_SIZE;
+	while (size - r->msglen < len) {
+		if (size > SIZE_MAX / 2)
 			return -1;
+		size *= 2;
+	}
+	if ((msg = realloc(r->msg, size)) == NULL)
+		return -1;
+	r->msg = msg;
+	r->msgsize = size;
+	return 0;
+}
+
+/* Append a fragment to the message being reassembled */
+static int
+readerAppend(struct wsReader *r, const uint8_t *data, size_t len)
+{
+	if (len == 0)
+		return 0;
+	if (readerGrow(r, len))
+		return -1;
+	memcpy(r->msg + r->msglen, data, len);
+	r->msglen += len;
+	return 0;
+}
+
+/*
+ * Decompress a fragment of a compressed message into the reassembly buffer.
+ * The end of the message is marked by the empty stored block the sender
+ * removed.  Returns the status code to close the connection with on errors,
+ * i.e. when the data is not valid or inflates to more than maxMessageSize.
+ */
+static uint16_t
+readerInflate(struct wsReader *r, const uint8_t *data, size_t len, int fin)
+{
+	static const uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	z_stream *zs;
+	size_t avail;
+	int ret;
+
+	if ((zs = r->zs) == NULL) {
+		if ((zs = calloc(1, sizeof(z_stream))) == NULL)
+			return 1011;
+		if (inflateInit2(zs, -r->inflateBits) != Z_OK) {
+			free(zs);
+			return 1011;
+		}
+		r->zs = zs;
+	}
+
+	zs->avail_in = 0;
+	for (;;) {
+		if (zs->avail_in == 0 && len > 0) {
+			zs->next_in = (uint8_t *)data;
+			zs->avail_in = len > UINT_MAX ? UINT_MAX : len;
+			data += zs->avail_in;
+			len -= zs->avail_in;
+		}
+		if (r->msgsize - r->msglen < 1024 && readerGrow(r,
+		    r->msgsize ? r->msgsize : READAHEAD_SIZE))
+			return 1011;
+		avail = r->msgsize - r->msglen;
+		zs->next_out = r->msg + r->msglen;
+		zs->avail_out = avail > UINT_MAX ? UINT_MAX : avail;
+		avail = zs->avail_out;
+
+		ret = inflate(zs, Z_SYNC_FLUSH);
+		r->msglen += avail - zs->avail_out;
+		if (r->maxMessageSize > 0 && r->msglen > r->maxMessageSize)
+			return 1009;
+		if (ret == Z_STREAM_END) {
+			/* A final block ends the stream, start a new one */
+			inflateReset(zs);
+			return 0;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return 1007;
+
+		/* All input is consumed once there is room left */
+		if (zs->avail_in == 0 && len == 0 && zs->avail_out > 0) {
+			if (!fin || data == tail + sizeof(tail))
+				break;
+			data = tail;
+			len = sizeof(tail);
+		}
+	}
+	if (fin && r->inflateNoContextTakeover)
+		inflateReset(zs);
+	return 0;
+}
+
+/*
+ * Called once the consumed frames are no longer referenced, i.e. before
+ * reading the next message.
+ */
+static void
+readerRelease(struct wsReader *r)
+{
+	if (r->msgtype == WS_EMPTY_FRAME) {
+		r->msglen = 0;
+		if (r->msgsize > READAHEAD_MAX) {
+			free(r->msg);
+			r->msg = NULL;
+			r->msgsize = 0;
 		}
+	}
 
-		payloadLength = wsGetPayloadLength(buf, len,
-		    &payloadFieldExtraBytes, &frameType);
-
-		if (payloadLength + payloadFieldExtraBytes > 0) {
-			/* Ensure buf can hold the complete payload */
-			if (6 + payloadFieldExtraBytes + payloadLength >
-			    bufsize) {
-				bufsize = 6 + payloadFieldExtraBytes +
-				    payloadLength;
-				buf = realloc(buf, bufsize);
-				if (buf == NULL)
-					return -1;
+	if (r->start < r->end)
+		return;
+	r->start = r->end = 0;
+
+	/* Do not keep the memory of an exceptionally large message around */
+	if (r->bufsize > READAHEAD_MAX) {
+		free(r->buf);
+		r->buf = NULL;
+		r->bufsize = 0;
+	}
+}
+
+/*
+ * Continue the validation of a compressed text message with the data
+ * inflated from offset on.  Returns nonzero if the message is not valid
+ * UTF-8.
+ */
+static int
+readerValidate(struct wsReader *r, size_t offset, int fin)
+{
+	static const uint8_t nokey[4];
+
+	if (r->msglen > offset)
+		r->utf8state = wsUnmaskUTF8(r->msg + offset,
+		    r->msglen - offset, nokey, r->utf8state);
+	return r->utf8state == WS_UTF8_REJECT ||
+	    (fin && r->utf8state != WS_UTF8_ACCEPT);
+}
+
+/* Fail the connection with a close frame carrying a status code */
+static void
+readerFail(uint16_t status,
+    int(*writefunc)(void *, unsigned char *, size_t), void *client_data)
+{
+	uint8_t ctl[4];
+	size_t ctllen;
+
+	status = htons(status);
+	wsMakeFrame((uint8_t *)&status, sizeof(status), ctl, &ctllen,
+	    WS_CLOSING_FRAME);
+	writefunc(client_data, ctl, ctllen);
+}
+
+/*
+ * Read the next text or binary message and return its type.  Data is read
+ * in large chunks into the read-ahead buffer of the reader, so several
+ * frames that arrive together are parsed from one read and bytes belonging
+ * to the next frame are kept for the next call.  Control frames are
+ * answered as they are encountered, also when they arrive between the
+ * fragments of a message.
+ *
+ * Unfragmented messages are unmasked in place and *dest points into the
+ * read-ahead buffer, fragmented messages are reassembled in a second buffer
+ * that is grown geometrically.  Either way the data remains valid until the
+ * next call to wsRead() or freeReader().  Messages exceeding maxMessageSize,
+ * WS_MAX_MESSAGE unless changed, are refused with status 1009 as soon as
+ * their frame header is seen.  If permessage-deflate was negotiated,
+ * compressed messages are inflated into the second buffer and the limit
+ * applies to the inflated size.
+ *
+ * Text messages are validated as UTF-8 while they are unmasked, or after
+ * they are inflated, and the connection is failed with status 1007 if they
+ * are not, as soon as the invalid fragment is seen.
+ *
+ * WS_CLOSING_FRAME is returned when the peer closed the connection,
+ * WS_ERROR_FRAME on errors.  If readfunc fails with errno set to EAGAIN,
+ * WS_INCOMPLETE_FRAME is returned; the data read so far is kept in the
+ * reader and wsRead() continues where it left off when called again.
+ */
+enum wsFrameType
+wsRead(struct wsReader *r, char **dest, size_t *destlen,
+    int(*readfunc)(void *, unsigned char *, size_t),
+    int(*writefunc)(void *, unsigned char *, size_t), void *client_data)
+{
+	uint8_t *frame, *data;
+	uint8_t ctl[2 + 125];
+	size_t avail, hdrlen, framelen, payloadLength, datasize, ctllen, msglen;
+	uint8_t payloadFieldExtraBytes, opcode;
+	enum wsFrameType frameType;
+	uint16_t status;
+	uint32_t utf8;
+	int nread, fin, compressed, validate;
+
+	readerRelease(r);
+	for (;;) {
+		frame = r->buf + r->start;
+		avail = r->end - r->start;
+		framelen = 0;
+
+		if (avail >= 2) {
+			fin = frame[0] & 0x80;
+			compressed = frame[0] & WS_RSV1;
+			opcode = frame[0] & 0x0f;
+			if (((frame[0] & 0x30) != 0x0) ||
+			    ((frame[1] & 0x80) != 0x80))
+				return WS_ERROR_FRAME;
+
+			/* Only the first frame of a message is flagged */
+			if (compressed && (r->inflateBits == 0 ||
+			    (opcode != WS_TEXT_FRAME &&
+			    opcode != WS_BINARY_FRAME))) {
+				readerFail(1002, writefunc, client_data);
+				return WS_ERROR_FRAME;
 			}
 
-			do {
-				nread = readfunc(client_data, buf + len,
-				    payloadLength + payloadFieldExtraBytes);
-				if (nread <= 0) {
-					free(buf);
-					return -1;
+			/* Control frames must not be fragmented */
+			if ((opcode & 0x08) && (!fin ||
+			    (frame[1] & 0x7f) > 125)) {
+				readerFail(1002, writefunc, client_data);
+				return WS_ERROR_FRAME;
+			}
+
+			hdrlen = 6;
+			if ((frame[1] & 0x7f) == 0x7e)
+				hdrlen += 2;
+			else if ((frame[1] & 0x7f) == 0x7f)
+				hdrlen += 8;
+			framelen = hdrlen;
+
+			if (avail >= hdrlen) {
+				frameType = WS_EMPTY_FRAME;
+				payloadLength = wsGetPayloadLength(frame, avail,
+				    &payloadFieldExtraBytes, &frameType);
+				if (frameType == WS_ERROR_FRAME ||
+				    payloadLength > SIZE_MAX - hdrlen)
+					return WS_ERROR_FRAME;
+				if (r->maxMessageSize > 0 && !(opcode & 0x08) &&
+				    (payloadLength > r->maxMessageSize ||
+				    r->msglen > r->maxMessageSize -
+				    payloadLength)) {
+					readerFail(1009, writefunc,
+					    client_data);
+					return WS_ERROR_FRAME;
 				}
-				len += nread;
-			} while (len < 6 + payloadFieldExtraBytes +
-			    payloadLength);
+				framelen += payloadLength;
+			}
+		}
+
+		if (framelen == 0 || avail < framelen) {
+			if (readerReserve(r, framelen))
+				return WS_ERROR_FRAME;
+			nread = readfunc(client_data, r->buf + r->end,
+			    r->bufsize - r->end);
+			if (nread < 0 && (errno == EAGAIN ||
+			    errno == EWOULDBLOCK))
+				return WS_INCOMPLETE_FRAME;
+			if (nread <= 0)		/* remote closed */
+				return WS_ERROR_FRAME;
+			r->end += nread;
+			continue;
 		}
 
-		type = wsParseInputFrame((unsigned char *)buf, len, &data,
-			&datasize);
+		/* Uncompressed text is validated while it is unmasked */
+		validate = !compressed && (opcode == WS_TEXT_FRAME ||
+		    (opcode == WS_CONTINUATION_FRAME &&
+		    r->msgtype == WS_TEXT_FRAME && !r->msgcompressed));
+		utf8 = opcode == WS_TEXT_FRAME ? WS_UTF8_ACCEPT : r->utf8state;
+		frameType = parseFrame(frame, framelen, &data, &datasize,
+		    validate ? &utf8 : NULL);
+		r->start += framelen;
 
-		switch (type) {
+		switch (frameType) {
 		case WS_CLOSING_FRAME:
-			wsMakeFrame(NULL, 0, (unsigned char *)buf, &datasize,
-			    WS_CLOSING_FRAME);
-			writefunc(client_data, buf, datasize);
-			free(buf);
-			return -1;
+			wsMakeFrame(NULL, 0, ctl, &ctllen, WS_CLOSING_FRAME);
+			writefunc(client_data, ctl, ctllen);
+			return WS_CLOSING_FRAME;
 		case WS_PING_FRAME:
-			if (data)
-				data[datasize] = '\0';
-			wsMakeFrame(data, datasize, (unsigned char *)buf,
-			    &datasize, WS_PONG_FRAME);
-			writefunc(client_data, buf, datasize);
-			len = 0;
-			type = WS_INCOMPLETE_FRAME;
+			wsMakeFrame(data, datasize, ctl, &ctllen,
+			    WS_PONG_FRAME);
+			writefunc(client_data, ctl, ctllen);
+			break;
+		case WS_PONG_FRAME:
 			break;
 		case WS_TEXT_FRAME:
-			if (data) {
-				data[datasize] = '\0';
-
-				*dest = strdup(data);
+		case WS_BINARY_FRAME:
+			/* No new message within a fragmented one */
+			if (r->msgtype != WS_EMPTY_FRAME) {
+				readerFail(1002, writefunc, client_data);
+				return WS_ERROR_FRAME;
+			}
+			r->utf8state = utf8;
+			if (compressed) {
+				r->msglen = 0;
+				if ((status = readerInflate(r, data, datasize,
+				    fin))) {
+					readerFail(status, writefunc,
+					    client_data);
+					return WS_ERROR_FRAME;
+				}
+				if (frameType == WS_TEXT_FRAME &&
+				    readerValidate(r, 0, fin)) {
+					readerFail(1007, writefunc,
+					    client_data);
+					return WS_ERROR_FRAME;
+				}
+				if (!fin) {
+					r->msgtype = frameType;
+					r->msgcompressed = 1;
+					break;
+				}
+				*dest = (char *)r->msg;
 				if (destlen != NULL)
-					*destlen = datasize;
-				if (*dest == NULL) {
-					free(buf);
-					return -1;
+					*destlen = r->msglen;
+				return frameType;
+			}
+			if (validate && (utf8 == WS_UTF8_REJECT ||
+			    (fin && utf8 != WS_UTF8_ACCEPT))) {
+				readerFail(1007, writefunc, client_data);
+				return WS_ERROR_FRAME;
+			}
+			if (!fin) {
+				r->msgtype = frameType;
+				r->msglen = 0;
+				if (readerAppend(r, data, datasize))
+					return WS_ERROR_FRAME;
+				break;
+			}
+			*dest = data ? (char *)data : (char *)frame;
+			if (destlen != NULL)
+				*destlen = datasize;
+			return frameType;
+		case WS_CONTINUATION_FRAME:
+			if (r->msgtype == WS_EMPTY_FRAME) {
+				readerFail(1002, writefunc, client_data);
+				return WS_ERROR_FRAME;
+			}
+			if (r->msgcompressed) {
+				msglen = r->msglen;
+				if ((status = readerInflate(r, data, datasize,
+				    fin)) == 0 && r->msgtype == WS_TEXT_FRAME &&
+				    readerValidate(r, msglen, fin))
+					status = 1007;
+				if (status) {
+					readerFail(status, writefunc,
+					    client_data);
+					return WS_ERROR_FRAME;
 				}
 			} else {
-				if (destlen != NULL)
-					*destlen = 0;
-				*dest = NULL;
+				if (validate && (utf8 == WS_UTF8_REJECT ||
+				    (fin && utf8 != WS_UTF8_ACCEPT))) {
+					readerFail(1007, writefunc,
+					    client_data);
+					return WS_ERROR_FRAME;
+				}
+				r->utf8state = utf8;
+				if (readerAppend(r, data, datasize))
+					return WS_ERROR_FRAME;
 			}
-			break;
-		case WS_INCOMPLETE_FRAME:
-			break;
+			if (!fin)
+				break;
+			frameType = r->msgtype;
+			r->msgtype = WS_EMPTY_FRAME;
+			r->msgcompressed = 0;
+			*dest = r->msg ? (char *)r->msg : (char *)frame;
+			if (destlen != NULL)
+				*destlen = r->msglen;
+			return frameType;
 		default:
-			free(buf);
+			return WS_ERROR_FRAME;
+		}
+	}
+}
+
+void
+nullDeflater(struct wsDeflater *d)
+{
+	d->zs = NULL;
+	d->windowBits = 0;
+	d->buf = NULL;
+	d->bufsize = d->buflen = 0;
+}
+
+void
+freeDeflater(struct wsDeflater *d)
+{
+	if (d->zs != NULL) {
+		deflateEnd(d->zs);
+		free(d->zs);
+	}
+	free(d->buf);
+	nullDeflater(d);
+}
+
+/* Set the compression parameters, a stream created with others is ended */
+void
+wsSetDeflater(struct wsDeflater *d, const struct wsDeflateParams *params)
+{
+	if (d->zs != NULL && (d->level != params->level ||
+	    d->memLevel != params->memLevel ||
+	    d->windowBits != params->serverMaxWindowBits)) {
+		deflateEnd(d->zs);
+		free(d->zs);
+		d->zs = NULL;
+	}
+	d->level = params->level;
+	d->memLevel = params->memLevel;
+	d->windowBits = params->serverMaxWindowBits;
+	d->noContextTakeover = params->serverNoContextTakeover;
+	d->threshold = params->threshold;
+}
+
+/* Use the negotiated permessage-deflate parameters for a connection */
+void
+wsEnableDeflate(struct wsReader *r, struct wsDeflater *d,
+    const struct wsDeflateParams *params)
+{
+	r->inflateBits = params->clientMaxWindowBits;
+	r->inflateNoContextTakeover = params->clientNoContextTakeover;
+	wsSetDeflater(d, params);
+}
+
+/*
+ * Forget the compression context of a connection after a message that was
+ * compressed elsewhere has been sent on it, the window of the client no
+ * longer holds the data the stream would refer to.
+ */
+void
+wsResetDeflater(struct wsDeflater *d)
+{
+	if (d->zs != NULL && !d->noContextTakeover)
+		deflateReset(d->zs);
+}
+
+static int
+deflaterReserve(struct wsDeflater *d, size_t size)
+{
+	uint8_t *buf;
+
+	if (d->bufsize >= size)
+		return 0;
+	if ((buf = realloc(d->buf, size)) == NULL)
+		return -1;
+	d->buf = buf;
+	d->bufsize = size;
+	return 0;
+}
+
+/*
+ * Append a frame containing a message to the buffer of the deflater.  If
+ * permessage-deflate was negotiated and the message is not smaller than the
+ * threshold, the message is compressed, the frame is flagged with RSV1 and
+ * the empty block that ends the flushed output is removed.  The zlib stream
+ * is created with the first message that is compressed.
+ */
+int
+wsDeflateFrame(struct wsDeflater *d, const uint8_t *data, size_t len,
+    enum wsFrameType type)
+{
+	uint8_t hdr[WS_MAX_HEADER];
+	z_stream *zs;
+	size_t start, pos, avail, hdrlen, clen;
+	int flush;
+
+	start = d->buflen;
+	if (d->windowBits == 0 || len < d->threshold) {
+		if (start + WS_MAX_HEADER + len < start ||
+		    deflaterReserve(d, start + WS_MAX_HEADER + len))
+			return -1;
+		hdrlen = wsMakeFrameHeader(len, d->buf + start, type);
+		memcpy(d->buf + start + hdrlen, data, len);
+		d->buflen += hdrlen + len;
+		return 0;
+	}
+
+	if ((zs = d->zs) == NULL) {
+		if ((zs = calloc(1, sizeof(z_stream))) == NULL)
 			return -1;
+		if (deflateInit2(zs, d->level, Z_DEFLATED, -d->windowBits,
+		    d->memLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(zs);
+			return -1;
+		}
+		d->zs = zs;
+	}
+
+	/* Compress behind room for the longest header */
+	pos = start + WS_MAX_HEADER;
+	if (deflaterReserve(d, pos + deflateBound(zs, len > UINT_MAX ?
+	    UINT_MAX : len) + 16))
+		return -1;
+	zs->avail_in = 0;
+	do {
+		if (zs->avail_in == 0 && len > 0) {
+			zs->next_in = (uint8_t *)data;
+			zs->avail_in = len > UINT_MAX ? UINT_MAX : len;
+			data += zs->avail_in;
+			len -= zs->avail_in;
 		}
-	} while (type == WS_INCOMPLETE_FRAME);
-	free(buf);
+		flush = len == 0 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+		if (d->bufsize - pos < 64 && deflaterReserve(d,
+		    d->bufsize * 2))
+			return -1;
+		avail = d->bufsize - pos;
+		zs->next_out = d->buf + pos;
+		zs->avail_out = avail > UINT_MAX ? UINT_MAX : avail;
+		avail = zs->avail_out;
+		if (deflate(zs, flush) == Z_STREAM_ERROR)
+			return -1;
+		pos += avail - zs->avail_out;
+	} while (zs->avail_in > 0 || len > 0 || zs->avail_out == 0);
+
+	/*
+	 * Remove 0x00 0x00 0xff 0xff, an empty message is a single 0x00.
+	 * Nothing is output at all if nothing was added since the last flush.
+	 */
+	clen = pos - (start + WS_MAX_HEADER);
+	if (clen >= 4)
+		clen -= 4;
+	if (clen == 0) {
+		d->buf[start + WS_MAX_HEADER] = 0x00;
+		clen = 1;
+	}
+
+	hdrlen = wsMakeFrameHeader(clen, hdr, type);
+	hdr[0] |= WS_RSV1;
+	if (hdrlen < WS_MAX_HEADER)
+		memmove(d->buf + start + hdrlen, d->buf + start +
+		    WS_MAX_HEADER, clen);
+	memcpy(d->buf + start, hdr, hdrlen);
+	d->buflen = start + hdrlen + clen;
+
+	if (d->noContextTakeover)
+		deflateReset(zs);
 	return 0;
 }
@@ -39,11 +39,33 @@ static const char versionField[] = "Sec-WebSocket-Version: ";
 static const char version[] = "13";
 static const char secret[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
+/* Maximum length of an unmasked frame header */
+#define WS_MAX_HEADER	10
+
+/* Maximum length of the opening handshake request */
+#define WS_MAX_HANDSHAKE	8192
+
+/* Room needed for the answer to the opening handshake */
+#define WS_MAX_ANSWER	512
+
+/* Default limit of the size of a received message */
+#define WS_MAX_MESSAGE	(16 * 1024 * 1024)
+
+/* Set in the first byte of the first frame of a compressed message */
+#define WS_RSV1		0x40
+
+/* UTF-8 validation of text messages, other states are within a character */
+#define WS_UTF8_ACCEPT	0
+#define WS_UTF8_REJECT	1
+
+struct z_stream_s;
+
 enum wsFrameType {
 	/* errors starting from 0xF0 */
 	WS_EMPTY_FRAME = 0xf0,
 	WS_ERROR_FRAME = 0xf1,
 	WS_INCOMPLETE_FRAME = 0xf2,
+	WS_CONTINUATION_FRAME = 0x00,
 	WS_TEXT_FRAME = 0x01,
 	WS_BINARY_FRAME = 0x02,
 	WS_PING_FRAME = 0x09,
@@ -58,34 +80,124 @@ enum wsState {
 	WS_STATE_CLOSING
 };
 
+/* Per-connection read-ahead buffer */
+struct wsReader {
+	uint8_t		*buf;
+	size_t		 bufsize;
+	size_t		 start;		/* first unconsumed byte */
+	size_t		 end;		/* end of the data read */
+
+	/* Reassembly of fragmented messages */
+	uint8_t		*msg;
+	size_t		 msgsize;
+	size_t		 msglen;
+	enum wsFrameType msgtype;	/* WS_EMPTY_FRAME if none pending */
+	uint32_t	 utf8state;	/* of the text message being read */
+
+	size_t		 maxMessageSize;	/* 0 means no limit */
+
+	/* permessage-deflate */
+	struct z_stream_s *zs;
+	int		 inflateBits;		/* 0 if not negotiated */
+	int		 inflateNoContextTakeover;
+	int		 msgcompressed;
+};
+
+/* permessage-deflate parameters, RFC 7692 */
+struct wsDeflateParams {
+	int		 enabled;
+	int		 level;
+	int		 memLevel;
+	int		 serverMaxWindowBits;	/* window we compress with */
+	int		 clientMaxWindowBits;	/* window the client may use */
+	int		 serverNoContextTakeover;
+	int		 clientNoContextTakeover;
+	size_t		 threshold;		/* smaller messages are sent as is */
+};
+
+/* Compression of outgoing messages */
+struct wsDeflater {
+	struct z_stream_s *zs;
+	int		 level;
+	int		 memLevel;
+	int		 windowBits;		/* 0 if not negotiated */
+	int		 noContextTakeover;
+	size_t		 threshold;
+
+	/* Frames built by wsDeflateFrame() */
+	uint8_t		*buf;
+	size_t		 bufsize;
+	size_t		 buflen;
+};
+
+/* Part of the request, points into the buffer it was parsed from */
+struct wsString {
+	const char	*s;
+	size_t		 len;
+};
+
 struct handshake {
-	char		*host;
-	char		*origin;
-	char		*key;
-	char		*resource;
+	struct wsString	 host;
+	struct wsString	 origin;
+	struct wsString	 key;
+	struct wsString	 resource;
+	struct wsString	 extensions;
+	struct wsDeflateParams deflate;	/* negotiated by wsNegotiateDeflate() */
+	int		 deflateAnnounce;
 	enum wsFrameType frameType;
+	size_t		 scanned;	/* bytes searched for the end */
 };
 
 extern enum wsFrameType wsParseHandshake(const uint8_t *, size_t,
     struct handshake *);
 
+extern int wsFeed(struct wsReader *, const uint8_t *, size_t);
+
+extern enum wsFrameType wsReadHandshake(struct wsReader *,
+    struct handshake *, int(*readfunc)(void *, unsigned char *, size_t),
+    void *);
+
+extern void wsDefaultDeflate(struct wsDeflateParams *);
+
+extern int wsNegotiateDeflate(struct handshake *,
+    const struct wsDeflateParams *);
+
 extern void wsGetHandshakeAnswer(const struct handshake *, uint8_t *,
     size_t *);
 
+extern size_t wsMakeFrameHeader(size_t, uint8_t *, enum wsFrameType);
+
 extern void wsMakeFrame(const uint8_t *, size_t, uint8_t *, size_t *,
     enum wsFrameType);
 
 extern size_t wsGetPayloadLength(const uint8_t *, size_t, uint8_t *,
     enum wsFrameType *);
 
+extern void wsUnmask(uint8_t *, size_t, const uint8_t *);
+extern uint32_t wsUnmaskUTF8(uint8_t *, size_t, const uint8_t *, uint32_t);
+
 extern enum wsFrameType wsParseInputFrame(uint8_t *, size_t, uint8_t **,
     size_t *);
 
-extern enum wsFrameType wsRead(char **dest, size_t *,
+extern enum wsFrameType wsRead(struct wsReader *, char **dest, size_t *,
     int(*readfunc)(void *, unsigned char *, size_t),
     int(*writefunc)(void *, unsigned char *, size_t), void *);
 
+extern void wsEnableDeflate(struct wsReader *, struct wsDeflater *,
+    const struct wsDeflateParams *);
+
+extern void wsSetDeflater(struct wsDeflater *,
+    const struct wsDeflateParams *);
+extern void wsResetDeflater(struct wsDeflater *);
+
+extern int wsDeflateFrame(struct wsDeflater *, const uint8_t *, size_t,
+    enum wsFrameType);
+
 extern void nullHandshake(struct handshake *);
 extern void freeHandshake(struct handshake *);
+extern void nullReader(struct wsReader *);
+extern void freeReader(struct wsReader *);
+extern void nullDeflater(struct wsDeflater *);
+extern void freeDeflater(struct wsDeflater *);
 
 #endif  /* __WEBSOCKET_H__ */
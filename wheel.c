@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A hierarchical timer wheel.  Adding and removing a timer takes constant
+ * time, so does advancing the wheel by a tick; a timer is moved down a
+ * level at most WHEEL_LEVELS - 1 times before it expires.  This keeps the
+ * cost of many timers that are rearmed again and again, like the
+ * keepalive timers of idle connections, independent of their number.
+ */
+
+#include <sys/queue.h>
+#include <stdint.h>
+
+#include "wheel.h"
+
+void
+wheel_init(struct wheel *w, uint64_t now)
+{
+	int level, slot;
+
+	w->now = now;
+	w->ntimers = 0;
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		for (slot = 0; slot < WHEEL_SLOTS; slot++)
+			LIST_INIT(&w->slots[level][slot]);
+}
+
+/* Put a timer into the slot of the lowest level that reaches its expiry */
+static void
+wheel_insert(struct wheel *w, struct timer *t)
+{
+	uint64_t delta;
+	int level;
+
+	delta = t->expires - w->now;
+	if (delta >= (uint64_t)1 << (WHEEL_LEVELS * WHEEL_BITS)) {
+		delta = ((uint64_t)1 << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+		t->expires = w->now + delta;
+	}
+	for (level = 0; delta >= (uint64_t)1 << ((level + 1) * WHEEL_BITS);
+	    level++)
+		;
+	LIST_INSERT_HEAD(&w->slots[level]
+	    [(t->expires >> (level * WHEEL_BITS)) & WHEEL_MASK], t, entries);
+}
+
+/*
+ * Arm a timer, or rearm it if it is armed already.  The slot of the current
+ * tick has been expired, so a timer is due at the next tick at the earliest.
+ */
+void
+wheel_add(struct wheel *w, struct timer *t, uint64_t expires)
+{
+	if (t->armed)
+		LIST_REMOVE(t, entries);
+	else {
+		t->armed = 1;
+		w->ntimers++;
+	}
+	t->expires = expires > w->now ? expires : w->now + 1;
+	wheel_insert(w, t);
+}
+
+void
+wheel_del(struct wheel *w, struct timer *t)
+{
+	if (!t->armed)
+		return;
+	LIST_REMOVE(t, entries);
+	t->armed = 0;
+	w->ntimers--;
+}
+
+/*
+ * Advance the wheel to the tick now and move the timers that expired to
+ * the list expired, they are no longer armed.
+ */
+void
+wheel_advance(struct wheel *w, uint64_t now, struct timerlist *expired)
+{
+	struct timerlist *slot;
+	struct timer *t;
+	uint64_t tick;
+	int level;
+
+	if (w->ntimers == 0) {
+		if (now > w->now)
+			w->now = now;
+		return;
+	}
+	while (w->now < now && w->ntimers > 0) {
+		tick = ++w->now;
+
+		/* Spread the next slot of a level over the level below */
+		for (level = 1; level < WHEEL_LEVELS &&
+		    (tick & (((uint64_t)1 << (level * WHEEL_BITS)) - 1)) == 0;
+		    level++) {
+			slot = &w->slots[level]
+			    [(tick >> (level * WHEEL_BITS)) & WHEEL_MASK];
+			while ((t = LIST_FIRST(slot)) != NULL) {
+				LIST_REMOVE(t, entries);
+				wheel_insert(w, t);
+			}
+		}
+
+		slot = &w->slots[0][tick & WHEEL_MASK];
+		while ((t = LIST_FIRST(slot)) != NULL) {
+			LIST_REMOVE(t, entries);
+			t->armed = 0;
+			w->ntimers--;
+			LIST_INSERT_HEAD(expired, t, entries);
+		}
+	}
+	if (now > w->now)
+		w->now = now;
+}
+
+/*
+ * Ticks until the wheel has to be advanced next, -1 if no timer is armed.
+ * This is the next occupied slot of level 0, but no later than the end of
+ * its round, when timers of the levels above move down.
+ */
+int64_t
+wheel_next(struct wheel *w)
+{
+	uint64_t tick;
+
+	if (w->ntimers == 0)
+		return -1;
+	for (tick = w->now + 1; (tick & WHEEL_MASK) != 0; tick++)
+		if (!LIST_EMPTY(&w->slots[0][tick & WHEEL_MASK]))
+			break;
+	return tick - w->now;
+}
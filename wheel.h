@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014 - 2024 by Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Micro Systems Marc Balmer nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A hierarchical timer wheel */
+
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <sys/queue.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Four levels of 64 slots.  Level 0 has a slot per tick, each slot of a
+ * higher level spans all slots of the level below.  Timers further out
+ * than 2^24 ticks are clamped.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	4
+
+struct timer {
+	LIST_ENTRY(timer) entries;
+	uint64_t	 expires;	/* tick */
+	int		 armed;
+	void		*arg;
+};
+
+LIST_HEAD(timerlist, timer);
+
+struct wheel {
+	uint64_t	 now;		/* last tick that was expired */
+	size_t		 ntimers;
+	struct timerlist slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+extern void wheel_init(struct wheel *, uint64_t);
+extern void wheel_add(struct wheel *, struct timer *, uint64_t);
+extern void wheel_del(struct wheel *, struct timer *);
+extern void wheel_advance(struct wheel *, uint64_t, struct timerlist *);
+extern int64_t wheel_next(struct wheel *);
+
+#endif /* __WHEEL_H__ */